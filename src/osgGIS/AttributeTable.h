@@ -0,0 +1,219 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STACK3D_OSGGIS_ATTRIBUTETABLE
+#define STACK3D_OSGGIS_ATTRIBUTETABLE
+
+#include <osg/Referenced>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <stdexcept>
+
+namespace osgGIS {
+
+//! @brief attributes of the features of a tile, stored by column
+//!
+//! Numbers are stored as doubles with a null flag per row, NaN is a value; strings are
+//! dictionary encoded, each distinct value is stored once per column and rows hold its
+//! code. Rows are keyed by feature id, see find().
+//!
+//! The postgis plugin attaches the table of a tile to the tile node as user data, it
+//! is not modified afterward and can be read from any thread.
+//!
+//! @note header only, it is used by the plugin and the viewer
+struct AttributeTable : osg::Referenced {
+    enum Type { NUMBER, STRING };
+
+    //! code of null strings
+    static const unsigned NULL_CODE = 0xffffffff;
+
+    AttributeTable()
+        : _sorted( true )
+    {}
+
+    //! adds a column, before any row
+    void addColumn( const std::string& name, Type type ) {
+        if ( !_fid.empty() ) {
+            throw std::runtime_error( "cannot add column '" + name + "' after rows" );
+        }
+
+        _columns.push_back( Column( name, type ) );
+    }
+
+    //! adds a row, with null values, for feature id
+    void addRow( unsigned featureId ) {
+        _fid.push_back( featureId );
+        _sorted = _sorted && ( _fid.size() == 1 || _fid[ _fid.size() - 2 ] <= featureId );
+
+        for ( std::vector< Column >::iterator c = _columns.begin(); c != _columns.end(); c++ ) {
+            if ( c->type == NUMBER ) {
+                c->numbers.push_back( 0 );
+                c->nulls.push_back( true );
+            }
+            else {
+                // a copy, the constant has no definition to bind a reference to
+                c->codes.push_back( unsigned( NULL_CODE ) );
+            }
+        }
+    }
+
+    //! sets the value of column in the last row
+    void setNumber( size_t column, double value ) {
+        Column& c = _columns.at( column );
+        c.numbers.back() = value;
+        c.nulls.back() = false;
+    }
+
+    //! sets the value of column in the last row
+    void setString( size_t column, const std::string& value ) {
+        Column& c = _columns.at( column );
+        const std::map< std::string, unsigned >::const_iterator found = c.codeOf.find( value );
+
+        if ( found != c.codeOf.end() ) {
+            c.codes.back() = found->second;
+        }
+        else {
+            c.codes.back() = unsigned( c.dictionary.size() );
+            c.codeOf.insert( std::make_pair( value, c.codes.back() ) );
+            c.dictionary.push_back( value );
+        }
+    }
+
+    //! sorts the feature ids for find(), to call once all rows are added
+    void index() {
+        for ( std::vector< Column >::iterator c = _columns.begin(); c != _columns.end(); c++ ) {
+            std::map< std::string, unsigned >().swap( c->codeOf );
+        }
+
+        _order.resize( _fid.size() );
+
+        for ( size_t r = 0; r < _order.size(); r++ ) {
+            _order[r] = r;
+        }
+
+        if ( !_sorted ) {
+            std::stable_sort( _order.begin(), _order.end(), RowLess( _fid ) );
+        }
+    }
+
+    //! @return false if the feature is not in the table
+    bool find( unsigned featureId, size_t& row ) const {
+        const std::vector< size_t >::const_iterator found =
+            std::lower_bound( _order.begin(), _order.end(), featureId, RowIdLess( _fid ) );
+
+        if ( found == _order.end() || _fid[ *found ] != featureId ) {
+            return false;
+        }
+
+        row = *found;
+        return true;
+    }
+
+    size_t numRows() const {
+        return _fid.size();
+    }
+
+    size_t numColumns() const {
+        return _columns.size();
+    }
+
+    const std::string& name( size_t column ) const {
+        return _columns.at( column ).name;
+    }
+
+    Type type( size_t column ) const {
+        return _columns.at( column ).type;
+    }
+
+    bool isNull( size_t column, size_t row ) const {
+        const Column& c = _columns.at( column );
+        return c.type == NUMBER ? c.nulls.at( row ) : c.codes.at( row ) == NULL_CODE;
+    }
+
+    //! values of a NUMBER column, by row, 0 for null, see isNull()
+    const std::vector< double >& numbers( size_t column ) const {
+        return _columns.at( column ).numbers;
+    }
+
+    //! codes of a STRING column, by row, index in the dictionary or NULL_CODE
+    const std::vector< unsigned >& codes( size_t column ) const {
+        return _columns.at( column ).codes;
+    }
+
+    //! distinct values of a STRING column
+    const std::vector< std::string >& dictionary( size_t column ) const {
+        return _columns.at( column ).dictionary;
+    }
+
+private:
+    struct Column {
+        Column( const std::string& n, Type t )
+            : name( n )
+            , type( t )
+        {}
+        std::string name;
+        Type type;
+        std::vector< double > numbers;
+        std::vector< bool > nulls;
+        std::vector< unsigned > codes;
+        std::vector< std::string > dictionary;
+        //! codes of the dictionary, only used while building
+        std::map< std::string, unsigned > codeOf;
+    };
+
+    //! compares rows by feature id, to sort them
+    struct RowLess {
+        RowLess( const std::vector< unsigned >& fid )
+            : _fid( fid )
+        {}
+
+        bool operator()( size_t a, size_t b ) const {
+            return _fid[a] < _fid[b];
+        }
+
+    private:
+        const std::vector< unsigned >& _fid;
+    };
+
+    //! compares the feature id of a row with a feature id, for lower_bound, a distinct
+    //! struct since size_t and unsigned may be the same type
+    struct RowIdLess {
+        RowIdLess( const std::vector< unsigned >& fid )
+            : _fid( fid )
+        {}
+
+        bool operator()( size_t row, unsigned featureId ) const {
+            return _fid[row] < featureId;
+        }
+
+    private:
+        const std::vector< unsigned >& _fid;
+    };
+
+    std::vector< unsigned > _fid;
+    std::vector< Column > _columns;
+    //! rows sorted by feature id
+    std::vector< size_t > _order;
+    bool _sorted;
+};
+
+}
+#endif
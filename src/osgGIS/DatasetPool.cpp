@@ -0,0 +1,152 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "DatasetPool.h"
+
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+
+#include <gdal_priv.h>
+
+namespace osgGIS {
+
+namespace {
+// the pager requests tiles of the same raster in bursts
+const double DEFAULT_MAX_IDLE_TIME = 30;
+
+const void* currentThread()
+{
+    return OpenThreads::Thread::CurrentThread();
+}
+}
+
+DatasetPool& DatasetPool::instance()
+{
+    static DatasetPool pool;
+    return pool;
+}
+
+DatasetPool::DatasetPool()
+    : _maxIdleTime( DEFAULT_MAX_IDLE_TIME )
+{}
+
+DatasetPool::~DatasetPool()
+{
+    for ( IdleMap::iterator f = _idle.begin(); f != _idle.end(); f++ ) {
+        for ( std::vector< Idle >::iterator i = f->second.begin(); i != f->second.end(); i++ ) {
+            GDALClose( i->raster );
+        }
+    }
+}
+
+double DatasetPool::maxIdleTime() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    return _maxIdleTime;
+}
+
+void DatasetPool::setMaxIdleTime( double seconds )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    _maxIdleTime = seconds;
+}
+
+// must be called with the lock held
+void DatasetPool::evict( std::vector< GDALDataset* >& expired )
+{
+    const osg::Timer_t now = osg::Timer::instance()->tick();
+
+    for ( IdleMap::iterator f = _idle.begin(); f != _idle.end(); f++ ) {
+        std::vector< Idle >& idle = f->second;
+
+        for ( size_t i = 0; i < idle.size(); ) {
+            if ( osg::Timer::instance()->delta_s( idle[i].since, now ) > _maxIdleTime ) {
+                expired.push_back( idle[i].raster );
+                idle[i] = idle.back();
+                idle.pop_back();
+            }
+            else {
+                i++;
+            }
+        }
+    }
+}
+
+GDALDataset* DatasetPool::acquire( const std::string& file )
+{
+    GDALDataset* raster = 0;
+    std::vector< GDALDataset* > expired;
+
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+        evict( expired );
+
+        std::vector< Idle >& idle = _idle[ file ];
+
+        if ( !idle.empty() ) {
+            // prefer the handle last used by this thread
+            size_t found = idle.size() - 1;
+
+            for ( size_t i = 0; i < idle.size(); i++ ) {
+                if ( idle[i].thread == currentThread() ) {
+                    found = i;
+                    break;
+                }
+            }
+
+            raster = idle[ found ].raster;
+            idle[ found ] = idle.back();
+            idle.pop_back();
+        }
+    }
+
+    // closing and opening take time, done outside the lock
+    for ( std::vector< GDALDataset* >::iterator r = expired.begin(); r != expired.end(); r++ ) {
+        GDALClose( *r );
+    }
+
+    if ( !raster ) {
+        raster = static_cast< GDALDataset* >( GDALOpen( file.c_str(), GA_ReadOnly ) );
+    }
+
+    return raster;
+}
+
+void DatasetPool::release( const std::string& file, GDALDataset* raster )
+{
+    if ( !raster ) {
+        return;
+    }
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    const Idle idle = { raster, currentThread(), osg::Timer::instance()->tick() };
+    _idle[ file ].push_back( idle );
+}
+
+DatasetPool::Handle::Handle( DatasetPool& pool, const std::string& file )
+    : _pool( pool )
+    , _file( file )
+    , _raster( pool.acquire( file ) )
+{}
+
+DatasetPool::Handle::~Handle()
+{
+    _pool.release( _file, _raster );
+}
+
+}
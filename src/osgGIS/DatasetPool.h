@@ -0,0 +1,127 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STACK3D_OSGGIS_DATASETPOOL
+#define STACK3D_OSGGIS_DATASETPOOL
+
+#include <osg/Timer>
+#include <OpenThreads/Mutex>
+
+#include <cpl_error.h>
+
+#include <string>
+#include <vector>
+#include <map>
+
+class GDALDataset;
+
+namespace osgGIS {
+
+//! @brief pool of opened GDAL datasets, keyed by file name
+//!
+//! A GDAL dataset must not be used by two threads at once: a handle is lent to
+//! one thread at a time and, when given back, is preferably lent again to the same
+//! thread, so each DatabasePager thread ends up with its own handle on each file.
+//! Handles unused for maxIdleTime() seconds are closed.
+//!
+//! @note the pool is in the osgGIS shared library, the postgis and mnt plugins share it
+struct DatasetPool {
+
+    static DatasetPool& instance();
+
+    //! RAII borrowed dataset, given back to the pool on destruction
+    struct Handle {
+        Handle( DatasetPool& pool, const std::string& file );
+
+        ~Handle();
+
+        GDALDataset* operator->() {
+            return _raster;
+        }
+
+        GDALDataset& operator*() {
+            return *_raster;
+        }
+
+        operator bool() const {
+            return _raster;
+        }
+
+    private:
+        DatasetPool& _pool;
+        const std::string _file;
+        GDALDataset* _raster;
+        // non copyable
+        Handle( const Handle& );
+        Handle operator=( const Handle& );
+    };
+
+    double maxIdleTime() const;
+
+    void setMaxIdleTime( double seconds );
+
+    ~DatasetPool();
+
+private:
+    struct Idle {
+        GDALDataset* raster;
+        const void* thread; // last user
+        osg::Timer_t since;
+    };
+    typedef std::map< std::string, std::vector< Idle > > IdleMap;
+
+    mutable OpenThreads::Mutex _mutex;
+    IdleMap _idle;
+    double _maxIdleTime;
+
+    DatasetPool();
+    GDALDataset* acquire( const std::string& file );
+    void release( const std::string& file, GDALDataset* raster );
+    void evict( std::vector< GDALDataset* >& expired );
+    // non copyable
+    DatasetPool( const DatasetPool& );
+    DatasetPool operator=( const DatasetPool& );
+};
+
+//! @brief collects the GDAL errors of the calling thread while in scope
+//!
+//! CPLSetErrorHandler is process wide, a handler pushed with CPLPushErrorHandler only
+//! applies to the calling thread: GDAL errors are silenced and the last one is kept.
+struct GdalErrorScope {
+    GdalErrorScope() {
+        CPLPushErrorHandler( CPLQuietErrorHandler );
+        CPLErrorReset();
+    }
+
+    ~GdalErrorScope() {
+        CPLPopErrorHandler();
+    }
+
+    //! @return the last error message, empty if there was no failure
+    const std::string error() const {
+        return CPLGetLastErrorType() >= CE_Failure ? CPLGetLastErrorMsg() : "";
+    }
+
+private:
+    // non copyable
+    GdalErrorScope( const GdalErrorScope& );
+    GdalErrorScope operator=( const GdalErrorScope& );
+};
+
+}
+#endif
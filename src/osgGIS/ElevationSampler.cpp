@@ -0,0 +1,121 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ElevationSampler.h"
+
+#include <gdal_priv.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+
+namespace osgGIS {
+
+ElevationSampler::ElevationSampler( GDALDataset* raster, double xmin, double ymin, double xmax, double ymax )
+    : _rasterWidth( raster->GetRasterXSize() )
+    , _rasterHeight( raster->GetRasterYSize() )
+    , _x( 0 )
+    , _y( 0 )
+    , _w( 0 )
+    , _h( 0 )
+{
+    double transform[6];
+    raster->GetGeoTransform( transform );
+
+    // assume square pixels
+    assert( std::abs( transform[4] ) < FLT_EPSILON );
+    assert( std::abs( transform[2] ) < FLT_EPSILON );
+
+    _originX = transform[0];
+    _originY = transform[3];
+    _pixelPerMetreX =  1.f/transform[1];
+    _pixelPerMetreY = -1.f/transform[5]; // image is top->bottom
+
+    // pixels whose centers surround the window, clamped to the raster
+    const int x0 = std::max( 0, int( std::floor( ( xmin - _originX )*_pixelPerMetreX - .5 ) ) );
+    const int y0 = std::max( 0, int( std::floor( ( _originY - ymax )*_pixelPerMetreY - .5 ) ) );
+    const int x1 = std::min( _rasterWidth - 1, int( std::floor( ( xmax - _originX )*_pixelPerMetreX + .5 ) ) );
+    const int y1 = std::min( _rasterHeight - 1, int( std::floor( ( _originY - ymin )*_pixelPerMetreY + .5 ) ) );
+
+    if ( x1 < x0 || y1 < y0 ) {
+        return; // no overlap
+    }
+
+    _x = x0;
+    _y = y0;
+    _w = x1 - x0 + 1;
+    _h = y1 - y0 + 1;
+    _grid.resize( _w * _h );
+
+    // gdal converts to float
+    GDALRasterBand* band = raster->GetRasterBand( 1 );
+    band->RasterIO( GF_Read, _x, _y, _w, _h, &_grid[0], _w, _h, GDT_Float32, 0, 0 );
+
+    int ok;
+    double dataOffset = band->GetOffset( &ok );
+
+    if ( ! ok ) {
+        dataOffset = 0.0;
+    }
+
+    double dataScale = band->GetScale( &ok );
+
+    if ( ! ok ) {
+        dataScale = 1.0;
+    }
+
+    if ( dataScale != 1.0 || dataOffset != 0.0 ) {
+        for ( std::vector< float >::iterator z = _grid.begin(); z != _grid.end(); z++ ) {
+            *z = float( *z * dataScale + dataOffset );
+        }
+    }
+}
+
+inline
+float ElevationSampler::at( int i, int j ) const
+{
+    // clamped to the window
+    i = std::min( std::max( i - _x, 0 ), _w - 1 );
+    j = std::min( std::max( j - _y, 0 ), _h - 1 );
+    return _grid[ j*_w + i ];
+}
+
+bool ElevationSampler::sample( double x, double y, double& z ) const
+{
+    const double px = ( x - _originX )*_pixelPerMetreX;
+    const double py = ( _originY - y )*_pixelPerMetreY;
+
+    if ( _grid.empty() || px < 0 || px >= _rasterWidth || py < 0 || py >= _rasterHeight ) {
+        return false;
+    }
+
+    // interpolate between pixel centers
+    const double u = px - .5;
+    const double v = py - .5;
+    const int i = int( std::floor( u ) );
+    const int j = int( std::floor( v ) );
+    const double a = u - i;
+    const double b = v - j;
+
+    z = ( 1-b ) * ( ( 1-a ) * at( i, j )   + a * at( i+1, j ) )
+        +  b    * ( ( 1-a ) * at( i, j+1 ) + a * at( i+1, j+1 ) );
+    return true;
+}
+
+}
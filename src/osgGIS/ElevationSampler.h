@@ -0,0 +1,60 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STACK3D_OSGGIS_ELEVATIONSAMPLER
+#define STACK3D_OSGGIS_ELEVATIONSAMPLER
+
+#include <vector>
+
+class GDALDataset;
+
+namespace osgGIS {
+
+//! @brief bilinear sampling of the first band of a raster over a window
+//!
+//! The pixels covering the window are read in one go and converted (scale and
+//! offset applied) to a float grid, sampling does not access the raster afterward.
+struct ElevationSampler {
+    //! @param raster georeferenced raster, north up
+    //! @param xmin, ymin, xmax, ymax window to read, in raster CRS
+    ElevationSampler( GDALDataset* raster, double xmin, double ymin, double xmax, double ymax );
+
+    //! @param x, y position in raster CRS
+    //! @param z elevation at this position, unchanged if outside the raster
+    //! @return false if the position is outside the raster
+    bool sample( double x, double y, double& z ) const;
+
+private:
+    double _originX;
+    double _originY;
+    double _pixelPerMetreX;
+    double _pixelPerMetreY;
+    int _rasterWidth;
+    int _rasterHeight;
+    // window in pixels
+    int _x;
+    int _y;
+    int _w;
+    int _h;
+    std::vector< float > _grid;
+
+    float at( int i, int j ) const;
+};
+
+}
+#endif
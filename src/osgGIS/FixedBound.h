@@ -0,0 +1,44 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STACK3D_OSGGIS_FIXEDBOUND
+#define STACK3D_OSGGIS_FIXEDBOUND
+
+#include <osg/Drawable>
+#include <osg/BoundingBox>
+
+namespace osgGIS {
+
+//! @brief bound computed by the creator of a drawable, for geometries osg cannot
+//!        bound from their vertex array: short positions of quantized tiles, or
+//!        instances placed by the vertex shader
+struct FixedBound : osg::Drawable::ComputeBoundingBoxCallback {
+    FixedBound( const osg::BoundingBox& bound )
+        : _bound( bound )
+    {}
+
+    osg::BoundingBox computeBound( const osg::Drawable& ) const {
+        return _bound;
+    }
+
+private:
+    const osg::BoundingBox _bound;
+};
+
+}
+#endif
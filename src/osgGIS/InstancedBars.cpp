@@ -0,0 +1,246 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "InstancedBars.h"
+#include "Shaders.h"
+#include "FixedBound.h"
+
+#include <osg/VertexAttribDivisor>
+
+#include <cassert>
+
+namespace osgGIS {
+
+namespace {
+// generic attributes, after the octNormal of quantized geometries
+const unsigned POSITION_ATTRIBUTE = 7;
+const unsigned SIZE_ATTRIBUTE = 8;
+
+// the template is a bar of width 1, z is the level of the vertex: 0 for the base,
+// 1 for the top of the sides and 2 for the cap
+const char* barVertexSource = {
+    "#version 120\n"
+    "attribute vec3 barPosition;\n"
+    "attribute vec2 barSize;\n"
+    "attribute float instanceId;\n"
+    "varying vec3 normal;\n"
+    "varying vec3 position;\n"
+    "\n"
+    "bool featureVisible( float id );\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    float z = gl_Vertex.z < 0.5 ? 0.0 : barSize.y - ( gl_Vertex.z < 1.5 ? barSize.x / 20.0 : 0.0 );\n"
+    "    vec4 vertex = vec4( barPosition + vec3( gl_Vertex.xy * barSize.x, z ), 1.0 );\n"
+    "    normal = normalize( gl_NormalMatrix * gl_Normal );\n"
+    "    position = vec3( gl_ModelViewMatrix * vertex );\n"
+    "    gl_Position = featureVisible( instanceId ) ? gl_ModelViewProjectionMatrix * vertex : vec4( 2.0, 2.0, 2.0, 1.0 );\n"
+    "}\n"
+};
+
+const char* barFragmentSource = {
+    "#version 120\n"
+    "varying vec3 normal;\n"
+    "varying vec3 position;\n"
+    "\n"
+    "vec4 lighting( vec3 n, vec3 position );\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    gl_FragColor = lighting( normalize( normal ), position );\n"
+    "}\n"
+};
+
+// same layout as Mesh::addBar: base, top of the sides, cap
+osg::Geometry* createTemplate()
+{
+    const float x = .5f;
+    const float e = 1.f/20;
+
+    const osg::Vec3 vb[8] = {
+        osg::Vec3( -x+e, -x  , 0 ),
+        osg::Vec3( x-e, -x  , 0 ),
+        osg::Vec3( x  , -x+e, 0 ),
+        osg::Vec3( x  ,  x-e, 0 ),
+        osg::Vec3( x-e,  x  , 0 ),
+        osg::Vec3( -x+e,  x  , 0 ),
+        osg::Vec3( -x  ,  x-e, 0 ),
+        osg::Vec3( -x  , -x+e, 0 )
+    };
+
+    const osg::Vec3 nb[8] = {
+        osg::Vec3( 0, -1, 0 ),
+        osg::Vec3( 0, -1, 0 ),
+        osg::Vec3( 1,  0, 0 ),
+        osg::Vec3( 1,  0, 0 ),
+        osg::Vec3( 0,  1, 0 ),
+        osg::Vec3( 0,  1, 0 ),
+        osg::Vec3( -1,  0, 0 ),
+        osg::Vec3( -1,  0, 0 )
+    };
+
+    const osg::Vec3 vc[4] = {
+        osg::Vec3( -x+e, -x+e, 2 ),
+        osg::Vec3( x-e, -x+e, 2 ),
+        osg::Vec3( x-e,  x-e, 2 ),
+        osg::Vec3( -x+e,  x-e, 2 )
+    };
+
+    osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array;
+    osg::ref_ptr<osg::Vec3Array> normals = new osg::Vec3Array;
+
+    for ( size_t i=0; i<8; i++ ) {
+        vertices->push_back( vb[i] );
+        normals->push_back( nb[i] );
+    }
+
+    for ( size_t i=0; i<8; i++ ) {
+        vertices->push_back( vb[i] + osg::Vec3( 0, 0, 1 ) );
+        normals->push_back( nb[i] );
+    }
+
+    for ( size_t i=0; i<4; i++ ) {
+        vertices->push_back( vc[i] );
+        normals->push_back( osg::Vec3( 0, 0, 1 ) );
+    }
+
+    // vertex indices for base, top of the side faces and cap
+    const unsigned short b[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    const unsigned short t[8] = { 8, 9, 10, 11, 12, 13, 14, 15 };
+    const unsigned short c[4] = { 16, 17, 18, 19 };
+
+    osg::ref_ptr<osg::DrawElementsUShort> elem = new osg::DrawElementsUShort( GL_TRIANGLES );
+
+    // sides, loop / indices
+    for ( size_t i=0; i<8; i++ ) {
+        elem->push_back( b[i] );
+        elem->push_back( b[( i+1 )%8] );
+        elem->push_back( t[i] );
+        elem->push_back( t[i] );
+        elem->push_back( b[( i+1 )%8] );
+        elem->push_back( t[( i+1 )%8] );
+    }
+
+    // top
+    elem->push_back( c[0] );
+    elem->push_back( c[1] );
+    elem->push_back( c[2] );
+    elem->push_back( c[0] );
+    elem->push_back( c[2] );
+    elem->push_back( c[3] );
+
+    // top bevel
+    for ( size_t i=0; i<4; i++ ) {
+        elem->push_back( t[( i*2 )%8] );
+        elem->push_back( t[( i*2+1 )%8] );
+        elem->push_back( c[i] );
+        elem->push_back( c[i] );
+        elem->push_back( t[( i*2+1 )%8] );
+        elem->push_back( c[( i+1 )%4] );
+    }
+
+    // top corners
+    for ( size_t i=0; i<4; i++ ) {
+        elem->push_back( t[( i*2+1 )%8] );
+        elem->push_back( t[( i*2+2 )%8] );
+        elem->push_back( c[( i+1 )%4] );
+    }
+
+    osg::ref_ptr<osg::Geometry> geom = new osg::Geometry;
+    geom->setVertexArray( vertices.get() );
+    geom->setNormalArray( normals.get() );
+    geom->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+    geom->addPrimitiveSet( elem.get() );
+    return geom.release();
+}
+
+osg::Program* createBarsProgram()
+{
+    osg::ref_ptr<osg::Program> program = new osg::Program;
+    program->addShader( new osg::Shader( osg::Shader::VERTEX, barVertexSource ) );
+    program->addShader( new osg::Shader( osg::Shader::FRAGMENT, barFragmentSource ) );
+    program->addShader( new osg::Shader( osg::Shader::FRAGMENT, LIGHTING_FRAGMENT_SOURCE ) );
+    program->addShader( new osg::Shader( osg::Shader::VERTEX, FEATURE_FILTER_VERTEX_SOURCE ) );
+    program->addBindAttribLocation( "barPosition", POSITION_ATTRIBUTE );
+    program->addBindAttribLocation( "barSize", SIZE_ATTRIBUTE );
+    program->addBindAttribLocation( "instanceId", INSTANCE_ID_ATTRIBUTE );
+    return program.release();
+}
+}
+
+osg::Program* instancedBarsProgram()
+{
+    static const osg::ref_ptr<osg::Program> program( createBarsProgram() );
+    return program.get();
+}
+
+osg::Geometry* instancedBars( osg::Vec3Array* positions, osg::Vec2Array* sizes, osg::UIntArray* ids )
+{
+    assert( positions && sizes && positions->size() == sizes->size() );
+    assert( ids && ( ids->empty() || ids->size() == positions->size() ) );
+
+    // each tile has its own geometry for the instance arrays, the template arrays are shared
+    static const osg::ref_ptr<osg::Geometry> barTemplate( createTemplate() );
+
+    osg::ref_ptr<osg::Geometry> geom = new osg::Geometry;
+    geom->setUseVertexBufferObjects( true );
+    geom->setVertexArray( barTemplate->getVertexArray() );
+    geom->setNormalArray( barTemplate->getNormalArray() );
+    geom->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+
+    // one value per instance
+    geom->setVertexAttribArray( POSITION_ATTRIBUTE, positions );
+    geom->setVertexAttribBinding( POSITION_ATTRIBUTE, osg::Geometry::BIND_PER_VERTEX );
+    geom->setVertexAttribArray( SIZE_ATTRIBUTE, sizes );
+    geom->setVertexAttribBinding( SIZE_ATTRIBUTE, osg::Geometry::BIND_PER_VERTEX );
+
+    if ( !ids->empty() ) {
+        geom->setVertexAttribArray( INSTANCE_ID_ATTRIBUTE, ids );
+        geom->setVertexAttribBinding( INSTANCE_ID_ATTRIBUTE, osg::Geometry::BIND_PER_VERTEX );
+    }
+
+    const osg::DrawElementsUShort* templateElem = static_cast< const osg::DrawElementsUShort* >( barTemplate->getPrimitiveSet( 0 ) );
+    osg::ref_ptr<osg::DrawElementsUShort> elem = new osg::DrawElementsUShort( GL_TRIANGLES, templateElem->begin(), templateElem->end() );
+    elem->setNumInstances( positions->size() );
+    geom->addPrimitiveSet( elem.get() );
+
+    osg::BoundingBox bound;
+
+    for ( size_t i = 0; i < positions->size(); i++ ) {
+        const osg::Vec3& p = ( *positions )[i];
+        const float halfWidth = .5f * ( *sizes )[i].x();
+        bound.expandBy( p - osg::Vec3( halfWidth, halfWidth, 0 ) );
+        bound.expandBy( p + osg::Vec3( halfWidth, halfWidth, ( *sizes )[i].y() ) );
+    }
+
+    geom->setComputeBoundingBoxCallback( new FixedBound( bound ) );
+
+    osg::StateSet* stateset = geom->getOrCreateStateSet();
+    stateset->setAttribute( new osg::VertexAttribDivisor( POSITION_ATTRIBUTE, 1 ) );
+    stateset->setAttribute( new osg::VertexAttribDivisor( SIZE_ATTRIBUTE, 1 ) );
+
+    if ( !ids->empty() ) {
+        stateset->setAttribute( new osg::VertexAttribDivisor( INSTANCE_ID_ATTRIBUTE, 1 ) );
+    }
+
+    stateset->setAttributeAndModes( instancedBarsProgram() );
+    stateset->addUniform( new osg::Uniform( "visibility", int( VISIBILITY_TEXTURE_UNIT ) ) );
+    return geom.release();
+}
+
+}
@@ -0,0 +1,43 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STACK3D_OSGGIS_INSTANCEDBARS
+#define STACK3D_OSGGIS_INSTANCEDBARS
+
+#include <osg/Geometry>
+#include <osg/Program>
+
+namespace osgGIS {
+
+//! @brief bars drawn with a single instanced call
+//!
+//! All bars share the bevelled box of Mesh::addBar, built once. The vertex shader of
+//! instancedBarsProgram() scales and translates it with the per instance attributes,
+//! the memory per bar is 5 floats.
+//!
+//! @param positions base centers of the bars, in world coordinates
+//! @param sizes width and height of the bars
+//! @param ids feature ids of the bars, empty without id column
+osg::Geometry* instancedBars( osg::Vec3Array* positions, osg::Vec2Array* sizes, osg::UIntArray* ids );
+
+//! @brief places and lights the bars, shared by all tiles of the module, the bars of
+//!        filtered features are hidden (see FEATURE_FILTER_VERTEX_SOURCE)
+osg::Program* instancedBarsProgram();
+
+}
+#endif
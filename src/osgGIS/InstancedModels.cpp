@@ -0,0 +1,334 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "InstancedModels.h"
+#include "Shaders.h"
+#include "FixedBound.h"
+
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/Math>
+#include <osg/NodeVisitor>
+#include <osg/Texture>
+#include <osg/VertexAttribDivisor>
+#include <osgDB/ReadFile>
+#include <osgUtil/Optimizer>
+#include <osgUtil/SmoothingVisitor>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+
+#include <map>
+#include <stdexcept>
+#include <cassert>
+#include <cmath>
+
+namespace osgGIS {
+
+namespace {
+// generic attributes, after those of instanced bars
+const unsigned POSITION_ATTRIBUTE = 9;
+const unsigned SCALE_ROTATION_ATTRIBUTE = 10;
+
+const unsigned SYMBOL_SIDES = 8;
+
+const char* modelVertexSource = {
+    "#version 120\n"
+    "attribute vec3 modelPosition;\n"
+    "attribute vec2 modelScaleRotation;\n"
+    "attribute float instanceId;\n"
+    "varying vec3 normal;\n"
+    "varying vec3 position;\n"
+    "\n"
+    "bool featureVisible( float id );\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    float c = cos( modelScaleRotation.y );\n"
+    "    float s = sin( modelScaleRotation.y );\n"
+    "    mat2 rotation = mat2( c, s, -s, c );\n"
+    "    vec4 vertex = vec4( modelPosition + modelScaleRotation.x * vec3( rotation * gl_Vertex.xy, gl_Vertex.z ), 1.0 );\n"
+    "    normal = normalize( gl_NormalMatrix * vec3( rotation * gl_Normal.xy, gl_Normal.z ) );\n"
+    "    position = vec3( gl_ModelViewMatrix * vertex );\n"
+    "    gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+    "    gl_Position = featureVisible( instanceId ) ? gl_ModelViewProjectionMatrix * vertex : vec4( 2.0, 2.0, 2.0, 1.0 );\n"
+    "}\n"
+};
+
+const char* modelFragmentSource = {
+    "#version 120\n"
+    "uniform sampler2D texture0;\n"
+    "uniform bool textured;\n"
+    "varying vec3 normal;\n"
+    "varying vec3 position;\n"
+    "\n"
+    "vec4 lighting( vec3 n, vec3 position );\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    vec4 color = lighting( normalize( normal ), position );\n"
+    "    if ( textured ) {\n"
+    "        color *= texture2D( texture0, gl_TexCoord[0].st );\n"
+    "    }\n"
+    "    gl_FragColor = color;\n"
+    "}\n"
+};
+
+//! the BUILTIN_CONE model
+osg::Node* createSymbol()
+{
+    osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array;
+    osg::ref_ptr<osg::Vec3Array> normals = new osg::Vec3Array;
+    osg::ref_ptr<osg::DrawElementsUShort> elem = new osg::DrawElementsUShort( GL_TRIANGLES );
+
+    const float r = .5f;
+    const float slope = r; // normal of a side (cos, sin, r) for a cone of height 1
+
+    // sides have their own apex to get smooth normals
+    for ( unsigned i = 0; i < SYMBOL_SIDES; i++ ) {
+        const float a0 = 2 * osg::PI * i / SYMBOL_SIDES;
+        const float a1 = 2 * osg::PI * ( i+1 ) / SYMBOL_SIDES;
+        const float am = .5f * ( a0 + a1 );
+        const unsigned short first = vertices->size();
+
+        vertices->push_back( osg::Vec3( r * std::cos( a0 ), r * std::sin( a0 ), 0 ) );
+        vertices->push_back( osg::Vec3( r * std::cos( a1 ), r * std::sin( a1 ), 0 ) );
+        vertices->push_back( osg::Vec3( 0, 0, 1 ) );
+        normals->push_back( osg::Vec3( std::cos( a0 ), std::sin( a0 ), slope ) );
+        normals->push_back( osg::Vec3( std::cos( a1 ), std::sin( a1 ), slope ) );
+        normals->push_back( osg::Vec3( std::cos( am ), std::sin( am ), slope ) );
+
+        for ( unsigned short v = first; v < first + 3; v++ ) {
+            elem->push_back( v );
+            ( *normals )[v].normalize();
+        }
+    }
+
+    // base, seen from below
+    const unsigned short center = vertices->size();
+    vertices->push_back( osg::Vec3( 0, 0, 0 ) );
+    normals->push_back( osg::Vec3( 0, 0, -1 ) );
+
+    for ( unsigned i = 0; i < SYMBOL_SIDES; i++ ) {
+        const float a = 2 * osg::PI * i / SYMBOL_SIDES;
+        vertices->push_back( osg::Vec3( r * std::cos( a ), r * std::sin( a ), 0 ) );
+        normals->push_back( osg::Vec3( 0, 0, -1 ) );
+    }
+
+    for ( unsigned i = 0; i < SYMBOL_SIDES; i++ ) {
+        elem->push_back( center );
+        elem->push_back( center + 1 + ( i+1 )%SYMBOL_SIDES );
+        elem->push_back( center + 1 + i );
+    }
+
+    osg::ref_ptr<osg::Geometry> geom = new osg::Geometry;
+    geom->setVertexArray( vertices.get() );
+    geom->setNormalArray( normals.get() );
+    geom->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+    geom->addPrimitiveSet( elem.get() );
+
+    osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+    geode->addDrawable( geom.get() );
+    return geode.release();
+}
+
+//! template preparation: the shader needs normals and to know which parts are textured
+struct PrepareTemplate : osg::NodeVisitor {
+    PrepareTemplate()
+        : osg::NodeVisitor( osg::NodeVisitor::TRAVERSE_ALL_CHILDREN )
+    {}
+
+    void apply( osg::Node& node ) {
+        flagTexture( node.getStateSet() );
+        traverse( node );
+    }
+
+    void apply( osg::Geode& geode ) {
+        flagTexture( geode.getStateSet() );
+
+        for ( unsigned i = 0; i < geode.getNumDrawables(); i++ ) {
+            osg::Geometry* geom = geode.getDrawable( i )->asGeometry();
+
+            if ( !geom ) {
+                continue;
+            }
+
+            if ( !geom->getNormalArray() ) {
+                osgUtil::SmoothingVisitor::smooth( *geom );
+            }
+
+            geom->setUseVertexBufferObjects( true );
+            flagTexture( geom->getStateSet() );
+        }
+    }
+
+private:
+    void flagTexture( osg::StateSet* stateset ) {
+        if ( stateset && stateset->getTextureAttribute( 0, osg::StateAttribute::TEXTURE ) ) {
+            stateset->addUniform( new osg::Uniform( "textured", true ) );
+        }
+    }
+};
+
+//! per tile copy of the template: instance arrays and primitives are its own
+struct Instantiate : osg::NodeVisitor {
+    Instantiate( osg::Vec3Array* positions, osg::Vec2Array* scaleRotations, osg::UIntArray* ids, const osg::BoundingBox& bound )
+        : osg::NodeVisitor( osg::NodeVisitor::TRAVERSE_ALL_CHILDREN )
+        , _positions( positions )
+        , _scaleRotations( scaleRotations )
+        , _ids( ids )
+        , _bound( bound )
+    {}
+
+    void apply( osg::Geode& geode ) {
+        for ( unsigned i = 0; i < geode.getNumDrawables(); i++ ) {
+            osg::Geometry* geom = geode.getDrawable( i )->asGeometry();
+
+            if ( !geom ) {
+                continue;
+            }
+
+            // one value per instance
+            geom->setVertexAttribArray( POSITION_ATTRIBUTE, _positions );
+            geom->setVertexAttribBinding( POSITION_ATTRIBUTE, osg::Geometry::BIND_PER_VERTEX );
+            geom->setVertexAttribArray( SCALE_ROTATION_ATTRIBUTE, _scaleRotations );
+            geom->setVertexAttribBinding( SCALE_ROTATION_ATTRIBUTE, osg::Geometry::BIND_PER_VERTEX );
+
+            if ( !_ids->empty() ) {
+                geom->setVertexAttribArray( INSTANCE_ID_ATTRIBUTE, _ids );
+                geom->setVertexAttribBinding( INSTANCE_ID_ATTRIBUTE, osg::Geometry::BIND_PER_VERTEX );
+            }
+
+            for ( unsigned p = 0; p < geom->getNumPrimitiveSets(); p++ ) {
+                osg::ref_ptr<osg::PrimitiveSet> prim =
+                    static_cast< osg::PrimitiveSet* >( geom->getPrimitiveSet( p )->clone( osg::CopyOp::DEEP_COPY_ALL ) );
+                prim->setNumInstances( _positions->size() );
+                geom->setPrimitiveSet( p, prim.get() );
+            }
+
+            geom->setComputeBoundingBoxCallback( new FixedBound( _bound ) );
+        }
+    }
+
+private:
+    osg::Vec3Array* const _positions;
+    osg::Vec2Array* const _scaleRotations;
+    osg::UIntArray* const _ids;
+    const osg::BoundingBox _bound;
+};
+
+osg::Program* createModelsProgram()
+{
+    osg::ref_ptr<osg::Program> program = new osg::Program;
+    program->addShader( new osg::Shader( osg::Shader::VERTEX, modelVertexSource ) );
+    program->addShader( new osg::Shader( osg::Shader::FRAGMENT, modelFragmentSource ) );
+    program->addShader( new osg::Shader( osg::Shader::FRAGMENT, LIGHTING_FRAGMENT_SOURCE ) );
+    program->addShader( new osg::Shader( osg::Shader::VERTEX, FEATURE_FILTER_VERTEX_SOURCE ) );
+    program->addBindAttribLocation( "modelPosition", POSITION_ATTRIBUTE );
+    program->addBindAttribLocation( "modelScaleRotation", SCALE_ROTATION_ATTRIBUTE );
+    program->addBindAttribLocation( "instanceId", INSTANCE_ID_ATTRIBUTE );
+    return program.release();
+}
+
+//! models are loaded once for all tiles, tiles are loaded by the pager threads
+class ModelCache {
+public:
+    static ModelCache& instance() {
+        static ModelCache cache;
+        return cache;
+    }
+
+    osg::Node* get( const std::string& model ) {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+
+        osg::ref_ptr<osg::Node>& node = _models[model];
+
+        if ( !node.valid() ) {
+            node = model == BUILTIN_CONE ? createSymbol() : osgDB::readNodeFile( model );
+
+            if ( !node.valid() ) {
+                _models.erase( model );
+                throw std::runtime_error( "cannot load model \"" + model + "\"" );
+            }
+
+            osgUtil::Optimizer optimizer;
+            optimizer.optimize( node.get(), osgUtil::Optimizer::FLATTEN_STATIC_TRANSFORMS );
+
+            PrepareTemplate prepare;
+            node->accept( prepare );
+        }
+
+        return node.get();
+    }
+
+private:
+    OpenThreads::Mutex _mutex;
+    std::map< std::string, osg::ref_ptr<osg::Node> > _models;
+};
+}
+
+osg::Program* instancedModelsProgram()
+{
+    static const osg::ref_ptr<osg::Program> program( createModelsProgram() );
+    return program.get();
+}
+
+osg::Node* instancedModels( const std::string& model, osg::Vec3Array* positions, osg::Vec2Array* scaleRotations, osg::UIntArray* ids )
+{
+    assert( positions && scaleRotations && positions->size() == scaleRotations->size() );
+    assert( ids && ( ids->empty() || ids->size() == positions->size() ) );
+
+    const osg::Node* modelTemplate = ModelCache::instance().get( model );
+
+    // any rotation of the model stays in the sphere around its origin through its bound
+    const osg::BoundingSphere& sphere = modelTemplate->getBound();
+    const float radius = sphere.center().length() + sphere.radius();
+
+    osg::BoundingBox bound;
+
+    for ( size_t i = 0; i < positions->size(); i++ ) {
+        const float r = radius * std::abs( ( *scaleRotations )[i].x() );
+        bound.expandBy( ( *positions )[i] - osg::Vec3( r, r, r ) );
+        bound.expandBy( ( *positions )[i] + osg::Vec3( r, r, r ) );
+    }
+
+    // nodes and drawables are copied, arrays and statesets are shared with the template
+    osg::ref_ptr<osg::Node> node = static_cast< osg::Node* >(
+                                       modelTemplate->clone( osg::CopyOp::DEEP_COPY_NODES | osg::CopyOp::DEEP_COPY_DRAWABLES ) );
+
+    Instantiate instantiate( positions, scaleRotations, ids, bound );
+    node->accept( instantiate );
+
+    osg::ref_ptr<osg::Group> group = new osg::Group;
+    group->addChild( node.get() );
+
+    osg::StateSet* stateset = group->getOrCreateStateSet();
+    stateset->setAttribute( new osg::VertexAttribDivisor( POSITION_ATTRIBUTE, 1 ) );
+    stateset->setAttribute( new osg::VertexAttribDivisor( SCALE_ROTATION_ATTRIBUTE, 1 ) );
+
+    if ( !ids->empty() ) {
+        stateset->setAttribute( new osg::VertexAttribDivisor( INSTANCE_ID_ATTRIBUTE, 1 ) );
+    }
+
+    stateset->setAttributeAndModes( instancedModelsProgram() );
+    stateset->addUniform( new osg::Uniform( "texture0", 0 ) );
+    stateset->addUniform( new osg::Uniform( "visibility", int( VISIBILITY_TEXTURE_UNIT ) ) );
+    stateset->addUniform( new osg::Uniform( "textured", false ) );
+    return group.release();
+}
+
+}
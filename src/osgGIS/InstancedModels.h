@@ -0,0 +1,52 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STACK3D_OSGGIS_INSTANCEDMODELS
+#define STACK3D_OSGGIS_INSTANCEDMODELS
+
+#include <osg/Node>
+#include <osg/Array>
+#include <osg/Program>
+
+#include <string>
+
+namespace osgGIS {
+
+//! model name of the built-in symbol, a cone of unit base diameter and height
+const char* const BUILTIN_CONE = "builtin:cone";
+
+//! @brief a model placed at each point with a single instanced call per drawable
+//!
+//! The model is loaded once, its static transforms are flattened and it is kept
+//! for the next tiles. Each tile shares its arrays and state, only the primitives
+//! and instance arrays are its own. The vertex shader of instancedModelsProgram()
+//! rotates the model around its vertical axis, scales and translates it.
+//!
+//! @param model file loaded by osgDB or BUILTIN_CONE
+//! @param positions where the model origin is placed, in world coordinates
+//! @param scaleRotations scale and counterclockwise rotation in radians
+//! @param ids feature ids of the instances, empty without id column
+//! @throw std::runtime_error if the model cannot be loaded
+osg::Node* instancedModels( const std::string& model, osg::Vec3Array* positions, osg::Vec2Array* scaleRotations, osg::UIntArray* ids );
+
+//! @brief places, lights and textures the models, shared by all tiles of the module, the
+//!        models of filtered features are hidden (see FEATURE_FILTER_VERTEX_SOURCE)
+osg::Program* instancedModelsProgram();
+
+}
+#endif
@@ -0,0 +1,645 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "PostgisConnection.h"
+
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+#include <osg/Notify>
+
+#include <iostream>
+#include <stdexcept>
+#include <sstream>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#define DEBUG_OUT if (0) std::cerr
+
+namespace osgGIS {
+
+// type oids from postgres catalog/pg_type.h, server headers are not needed otherwise
+namespace {
+const Oid BOOLOID = 16;
+const Oid NAMEOID = 19;
+const Oid INT8OID = 20;
+const Oid INT2OID = 21;
+const Oid INT4OID = 23;
+const Oid TEXTOID = 25;
+const Oid FLOAT4OID = 700;
+const Oid FLOAT8OID = 701;
+const Oid BPCHAROID = 1042;
+const Oid VARCHAROID = 1043;
+const Oid NUMERICOID = 1700;
+
+// sign field of binary numerics
+const unsigned short NUMERIC_NEG = 0x4000;
+const unsigned short NUMERIC_NAN = 0xC000;
+
+const char* CURSOR_NAME = "horao_cursor";
+
+// enough for the DatabasePager threads
+const size_t DEFAULT_MAX_IDLE = 8;
+
+// leaves most of the server connections (100 by default) to other clients
+const size_t DEFAULT_MAX_ACTIVE = 16;
+
+// borrows between two reports of the pool statistics, at the OSG_INFO level
+const unsigned long STATS_PERIOD = 100;
+
+// values are sent in network byte order
+template< typename T >
+T networkValue( const char* data )
+{
+    unsigned char bytes[ sizeof( T ) ];
+    std::memcpy( bytes, data, sizeof( T ) );
+    T v = 0;
+
+    for ( size_t i = 0; i < sizeof( T ); i++ ) {
+        v = ( v << 8 ) | bytes[i];
+    }
+
+    return v;
+}
+
+// binary numeric: ndigits, weight, sign and dscale as int16, then ndigits base 10000
+// digits, the first one weighted by 10000^weight
+double numericValue( const char* data )
+{
+    const short numDigits = static_cast< short >( networkValue< unsigned short >( data ) );
+    const short weight = static_cast< short >( networkValue< unsigned short >( data + 2 ) );
+    const unsigned short sign = networkValue< unsigned short >( data + 4 );
+
+    if ( sign == NUMERIC_NAN ) {
+        return std::numeric_limits< double >::quiet_NaN();
+    }
+
+    double v = 0;
+
+    for ( short i = 0; i < numDigits; i++ ) {
+        v += networkValue< unsigned short >( data + 8 + 2*i ) * std::pow( 10000., weight - i );
+    }
+
+    return sign == NUMERIC_NEG ? -v : v;
+}
+}
+
+PostgisConnection::PostgisConnection( const std::string& connInfo )
+    : _conn( PQconnectdb( connInfo.c_str() ) )
+{}
+
+PostgisConnection::~PostgisConnection()
+{
+    if ( _conn ) {
+        PQfinish( _conn );
+    }
+}
+
+PostgisConnection::operator bool() const
+{
+    return CONNECTION_OK == PQstatus( _conn );
+}
+
+bool PostgisConnection::idle() const
+{
+    return CONNECTION_OK == PQstatus( _conn ) && PQTRANS_IDLE == PQtransactionStatus( _conn );
+}
+
+bool PostgisConnection::reset()
+{
+    _prepared.clear();
+    PQreset( _conn );
+    return CONNECTION_OK == PQstatus( _conn );
+}
+
+bool PostgisConnection::ping()
+{
+    PGresult* res = PQexec( _conn, "" );
+    const bool ok = PGRES_EMPTY_QUERY == PQresultStatus( res );
+    PQclear( res );
+    return ok;
+}
+
+const std::string PostgisConnection::prepare( const std::string& query, int numParams )
+{
+    const std::map< std::string, std::string >::const_iterator found = _prepared.find( query );
+
+    if ( found != _prepared.end() ) {
+        return found->second;
+    }
+
+    std::stringstream name;
+    name << "horao_query_" << _prepared.size();
+
+    const std::vector< Oid > types( numParams, FLOAT8OID );
+    PGresult* res = PQprepare( _conn, name.str().c_str(), query.c_str(), numParams, numParams ? &types[0] : NULL );
+    const std::string error( PQresultErrorMessage( res ) );
+    PQclear( res );
+
+    if ( !error.empty() ) {
+        throw std::runtime_error( error );
+    }
+
+    _prepared[ query ] = name.str();
+    return name.str();
+}
+
+PostgisConnection::QueryResult::QueryResult( PostgisConnection& conn, const std::string& query )
+    : _res( PQexec( conn._conn, query.c_str() ) )
+    , _error( PQresultErrorMessage( _res ) )
+{}
+
+PostgisConnection::QueryResult::~QueryResult()
+{
+    PQclear( _res );
+}
+
+PostgisConnection::RowStream::RowStream( PostgisConnection& conn, const std::string& query, int fetchSize )
+    : _conn( conn )
+    , _fetchSize( fetchSize )
+    , _res( 0 )
+    , _done( false )
+    , _prefetcher( 0 )
+    , _cancel( 0 )
+    , _maxQueued( 0 )
+    , _fetched( false )
+    , _stop( false )
+{
+    start( query, std::vector< std::string >() );
+}
+
+PostgisConnection::RowStream::RowStream( PostgisConnection& conn, const std::string& query, const std::vector< std::string >& params, int fetchSize )
+    : _conn( conn )
+    , _fetchSize( fetchSize )
+    , _res( 0 )
+    , _done( false )
+    , _prefetcher( 0 )
+    , _cancel( 0 )
+    , _maxQueued( 0 )
+    , _fetched( false )
+    , _stop( false )
+{
+    start( query, params );
+}
+
+void PostgisConnection::RowStream::start( const std::string& query, const std::vector< std::string >& params )
+{
+    std::vector< const char* > values;
+
+    for ( std::vector< std::string >::const_iterator p = params.begin(); p != params.end(); p++ ) {
+        values.push_back( p->c_str() );
+    }
+
+    const int numParams = int( values.size() );
+    const std::vector< Oid > types( numParams, FLOAT8OID );
+
+    if ( _fetchSize > 0 ) {
+        // a cursor only lives inside a transaction
+        std::string select( query );
+        const size_t end = select.find_last_not_of( " \t\n;" );
+        select.erase( end == std::string::npos ? 0 : end + 1 );
+
+        QueryResult begin( _conn, "BEGIN" );
+
+        if ( !begin ) {
+            fail( begin.error() );
+            return;
+        }
+
+        // cursors cannot be declared from prepared statements, the parameters are bound though
+        const std::string declare = std::string( "DECLARE " ) + CURSOR_NAME + " NO SCROLL CURSOR FOR " + select;
+        PGresult* res = PQexecParams( _conn._conn, declare.c_str(), numParams,
+                                      numParams ? &types[0] : NULL, numParams ? &values[0] : NULL, NULL, NULL, 1 );
+
+        if ( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+            fail( PQresultErrorMessage( res ) );
+        }
+
+        PQclear( res );
+    }
+    else if ( numParams ) {
+        std::string name;
+
+        try {
+            name = _conn.prepare( query, numParams );
+        }
+        catch ( std::exception& e ) {
+            fail( e.what() );
+            return;
+        }
+
+        if ( !PQsendQueryPrepared( _conn._conn, name.c_str(), numParams, &values[0], NULL, NULL, 1 )
+                || !PQsetSingleRowMode( _conn._conn ) ) {
+            fail( PQerrorMessage( _conn._conn ) );
+        }
+    }
+    else {
+        if ( !PQsendQueryParams( _conn._conn, query.c_str(), 0, NULL, NULL, NULL, NULL, 1 )
+                || !PQsetSingleRowMode( _conn._conn ) ) {
+            fail( PQerrorMessage( _conn._conn ) );
+        }
+    }
+}
+
+PostgisConnection::RowStream::~RowStream()
+{
+    clear();
+    stopPrefetch();
+
+    if ( _fetchSize > 0 ) {
+        if ( _error.empty() ) {
+            QueryResult close( _conn, std::string( "CLOSE " ) + CURSOR_NAME );
+            QueryResult commit( _conn, "COMMIT" );
+        }
+        else {
+            QueryResult rollback( _conn, "ROLLBACK" );
+        }
+    }
+    else if ( !_done || !_error.empty() ) {
+        // stopped before the end, the connection must be usable again
+        if ( !_done ) {
+            PGcancel* cancel = PQgetCancel( _conn._conn );
+
+            if ( cancel ) {
+                char errbuf[256];
+                PQcancel( cancel, errbuf, sizeof( errbuf ) );
+                PQfreeCancel( cancel );
+            }
+        }
+
+        while ( PGresult* res = PQgetResult( _conn._conn ) ) {
+            PQclear( res );
+        }
+    }
+}
+
+void PostgisConnection::RowStream::clear()
+{
+    if ( _res ) {
+        PQclear( _res );
+        _res = 0;
+    }
+}
+
+void PostgisConnection::RowStream::fail( const std::string& msg )
+{
+    _error = msg.empty() ? "unknown postgres error" : msg;
+    _done = true;
+}
+
+PGresult* PostgisConnection::RowStream::fetch()
+{
+    if ( _done ) {
+        return 0;
+    }
+
+    if ( _fetchSize > 0 ) {
+        std::stringstream fetch;
+        fetch << "FETCH FORWARD " << _fetchSize << " FROM " << CURSOR_NAME;
+        PGresult* res = PQexecParams( _conn._conn, fetch.str().c_str(), 0, NULL, NULL, NULL, NULL, 1 );
+
+        if ( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+            fail( PQresultErrorMessage( res ) );
+            PQclear( res );
+            return 0;
+        }
+
+        _done = PQntuples( res ) < _fetchSize;
+        return res;
+    }
+
+    PGresult* res = PQgetResult( _conn._conn );
+
+    if ( !res ) {
+        _done = true;
+        return 0;
+    }
+
+    switch ( PQresultStatus( res ) ) {
+    case PGRES_SINGLE_TUPLE:
+        return res;
+    case PGRES_TUPLES_OK:
+        // end of the result set, zero rows, there is a NULL result after it
+        _done = true;
+
+        while ( PGresult* last = PQgetResult( _conn._conn ) ) {
+            PQclear( last );
+        }
+
+        return res;
+    default:
+        fail( PQresultErrorMessage( res ) );
+        PQclear( res );
+        return 0;
+    }
+}
+
+bool PostgisConnection::RowStream::next()
+{
+    clear();
+
+    if ( !_prefetcher ) {
+        _res = fetch();
+        return _res;
+    }
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _queueMutex );
+
+    while ( _queue.empty() && !_fetched ) {
+        _queueCond.wait( &_queueMutex );
+    }
+
+    if ( _queue.empty() ) {
+        return false;
+    }
+
+    _res = _queue.front();
+    _queue.pop_front();
+    _queueCond.broadcast();
+    return true;
+}
+
+//! fetches batches in the background and queues them for RowStream::next()
+struct PostgisConnection::RowStream::Prefetcher : OpenThreads::Thread {
+    Prefetcher( RowStream& rows )
+        : _rows( rows )
+    {}
+
+    void run() {
+        for ( ;; ) {
+            PGresult* res = _rows.fetch();
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _rows._queueMutex );
+
+            while ( res && !_rows._stop && _rows._queue.size() >= _rows._maxQueued ) {
+                _rows._queueCond.wait( &_rows._queueMutex );
+            }
+
+            if ( !res || _rows._stop ) {
+                if ( res ) {
+                    PQclear( res );
+                }
+
+                _rows._fetched = true;
+                _rows._queueCond.broadcast();
+                return;
+            }
+
+            _rows._queue.push_back( res );
+            _rows._queueCond.broadcast();
+        }
+    }
+
+private:
+    RowStream& _rows;
+};
+
+void PostgisConnection::RowStream::prefetch( size_t maxQueued )
+{
+    if ( _prefetcher || _done || !maxQueued ) {
+        return;
+    }
+
+    _maxQueued = maxQueued;
+    _cancel = PQgetCancel( _conn._conn );
+    _prefetcher = new Prefetcher( *this );
+    _prefetcher->startThread();
+}
+
+void PostgisConnection::RowStream::stopPrefetch()
+{
+    if ( !_prefetcher ) {
+        return;
+    }
+
+    bool fetched;
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _queueMutex );
+        _stop = true;
+        fetched = _fetched;
+        _queueCond.broadcast();
+    }
+
+    // the fetcher may be waiting for the server
+    if ( !fetched && _cancel && _fetchSize <= 0 ) {
+        char errbuf[256];
+        PQcancel( _cancel, errbuf, sizeof( errbuf ) );
+    }
+
+    _prefetcher->join();
+    delete _prefetcher;
+    _prefetcher = 0;
+
+    if ( _cancel ) {
+        PQfreeCancel( _cancel );
+        _cancel = 0;
+    }
+
+    for ( std::deque< PGresult* >::iterator res = _queue.begin(); res != _queue.end(); res++ ) {
+        PQclear( *res );
+    }
+
+    _queue.clear();
+}
+
+ConnectionPool& ConnectionPool::instance()
+{
+    static ConnectionPool pool;
+    return pool;
+}
+
+ConnectionPool::ConnectionPool()
+    : _maxIdle( DEFAULT_MAX_IDLE )
+    , _maxActive( DEFAULT_MAX_ACTIVE )
+{}
+
+ConnectionPool::~ConnectionPool()
+{
+    for ( IdleMap::iterator c = _idle.begin(); c != _idle.end(); c++ ) {
+        for ( std::vector< PostgisConnection* >::iterator conn = c->second.begin(); conn != c->second.end(); conn++ ) {
+            delete *conn;
+        }
+    }
+}
+
+const ConnectionPool::Stats ConnectionPool::stats() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    return _stats;
+}
+
+size_t ConnectionPool::maxIdle() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    return _maxIdle;
+}
+
+void ConnectionPool::setMaxIdle( size_t maxIdle )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    _maxIdle = maxIdle;
+}
+
+size_t ConnectionPool::maxActive() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    return _maxActive;
+}
+
+void ConnectionPool::setMaxActive( size_t maxActive )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    _maxActive = std::max( maxActive, size_t( 1 ) );
+    _released.broadcast();
+}
+
+PostgisConnection* ConnectionPool::acquire( const std::string& connInfo )
+{
+    PostgisConnection* conn = 0;
+    Stats report;
+
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+        size_t& active = _active[ connInfo ];
+
+        if ( active >= _maxActive ) {
+            _stats.waited++;
+        }
+
+        while ( active >= _maxActive ) {
+            _released.wait( &_mutex );
+        }
+
+        active++;
+        std::vector< PostgisConnection* >& idle = _idle[ connInfo ];
+
+        if ( !idle.empty() ) {
+            conn = idle.back();
+            idle.pop_back();
+            _stats.reused++;
+        }
+        else {
+            _stats.created++;
+        }
+
+        if ( ( _stats.created + _stats.reused ) % STATS_PERIOD == 0 ) {
+            report = _stats;
+        }
+    }
+
+    if ( report.created + report.reused ) {
+        OSG_INFO << "postgis connection pool: " << report.created + report.reused << " borrows, "
+                 << report.created << " created, " << report.reused << " reused, "
+                 << report.closed << " closed, " << report.waited << " waited\n";
+    }
+
+    // connecting takes time, done outside the lock
+    if ( !conn ) {
+        return new PostgisConnection( connInfo );
+    }
+
+    // the server may have closed it while idle, which libpq only notices on the next
+    // exchange, hence the round trip
+    if ( !conn->ping() && !conn->reset() ) {
+        DEBUG_OUT << "pooled connection is broken, reconnection failed\n";
+    }
+
+    return conn;
+}
+
+void ConnectionPool::release( const std::string& connInfo, PostgisConnection* conn )
+{
+    const bool reusable = conn->idle();
+
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+        _active[ connInfo ]--;
+        // waiters may be borrowing for another conn_info
+        _released.broadcast();
+        std::vector< PostgisConnection* >& idle = _idle[ connInfo ];
+
+        if ( reusable && idle.size() < _maxIdle ) {
+            idle.push_back( conn );
+            return;
+        }
+
+        _stats.closed++;
+    }
+
+    delete conn;
+}
+
+ConnectionPool::Lease::Lease( ConnectionPool& pool, const std::string& connInfo )
+    : _pool( pool )
+    , _connInfo( connInfo )
+    , _conn( pool.acquire( connInfo ) )
+{}
+
+ConnectionPool::Lease::~Lease()
+{
+    _pool.release( _connInfo, _conn );
+}
+
+double binaryNumber( const PGresult* res, int row, int column )
+{
+    const char* data = PQgetvalue( res, row, column );
+
+    switch ( PQftype( res, column ) ) {
+    case FLOAT8OID: {
+        const unsigned long long v = networkValue< unsigned long long >( data );
+        double d;
+        std::memcpy( &d, &v, sizeof( d ) );
+        return d;
+    }
+    case FLOAT4OID: {
+        const unsigned v = networkValue< unsigned >( data );
+        float f;
+        std::memcpy( &f, &v, sizeof( f ) );
+        return f;
+    }
+    case INT8OID:
+        return static_cast< long long >( networkValue< unsigned long long >( data ) );
+    case INT4OID:
+        return static_cast< int >( networkValue< unsigned >( data ) );
+    case INT2OID:
+        return static_cast< short >( networkValue< unsigned short >( data ) );
+    case BOOLOID:
+        return *data ? 1 : 0;
+    case NUMERICOID:
+        return numericValue( data );
+    }
+
+    std::stringstream msg;
+    msg << "unsupported type for column '" << PQfname( res, column ) << "', cast it to float8";
+    throw std::runtime_error( msg.str() );
+}
+
+bool isText( const PGresult* res, int column )
+{
+    const Oid type = PQftype( res, column );
+    return type == TEXTOID || type == VARCHAROID || type == BPCHAROID || type == NAMEOID;
+}
+
+bool isNumber( const PGresult* res, int column )
+{
+    const Oid type = PQftype( res, column );
+    return type == FLOAT8OID || type == FLOAT4OID || type == INT8OID || type == INT4OID
+           || type == INT2OID || type == BOOLOID || type == NUMERICOID;
+}
+
+}
@@ -0,0 +1,261 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STACK3D_OSGGIS_POSTGISCONNECTION
+#define STACK3D_OSGGIS_POSTGISCONNECTION
+
+#include <libpq-fe.h>
+
+#include <OpenThreads/Mutex>
+#include <OpenThreads/Condition>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+namespace osgGIS {
+
+//! for postgres connection RAII
+struct PostgisConnection {
+
+    PostgisConnection( const std::string& connInfo );
+
+    ~PostgisConnection();
+
+    operator bool() const;
+
+    //! @return true if the connection is ok and not inside a transaction
+    bool idle() const;
+
+    //! reconnect with the same parameters
+    //! @return true if the connection is ok afterward
+    //! @note prepared statements are lost
+    bool reset();
+
+    //! round trip to the server (empty query), detects a connection the server closed
+    //! @return true if the connection is ok
+    bool ping();
+
+    //! prepare the query on first use, parameters are float8
+    //! @return the name of the prepared statement
+    //! @throw if the query cannot be prepared
+    const std::string prepare( const std::string& query, int numParams );
+
+    // for RAII ok query results
+    struct QueryResult {
+        QueryResult( PostgisConnection& conn, const std::string& query );
+
+        ~QueryResult();
+
+        operator bool() const {
+            return _error.empty();
+        }
+
+        PGresult* get() {
+            return _res;
+        }
+
+        const std::string& error() const {
+            return _error;
+        }
+
+    private:
+        PGresult* _res;
+        const std::string _error;
+        // non copyable
+        QueryResult( const QueryResult& );
+        QueryResult operator=( const QueryResult& );
+    };
+
+    //! @brief fetch query results in binary format, one batch at a time,
+    //!        such that only the current batch is held in memory
+    //!
+    //! With fetchSize == 0 the rows arrive one by one (libpq single row mode),
+    //! otherwise they are fetched fetchSize at a time from a cursor (the query
+    //! must then be a SELECT).
+    //!
+    //! Parameters ($1, $2...) are float8, in single row mode the query is prepared once
+    //! per connection and only the parameters are sent afterward.
+    //!
+    //! @note the last batch may be empty, it is returned anyway so that
+    //!       columns can be looked up on empty results
+    struct RowStream {
+        RowStream( PostgisConnection& conn, const std::string& query, int fetchSize = 0 );
+        RowStream( PostgisConnection& conn, const std::string& query, const std::vector< std::string >& params, int fetchSize = 0 );
+
+        ~RowStream();
+
+        //! @return false when there is no more batch or on error
+        bool next();
+
+        //! @brief fetch the next batches in a background thread while the current one
+        //!        is processed, at most maxQueued batches are kept in advance
+        //! @note the connection must not be used by the caller until the stream is destroyed
+        void prefetch( size_t maxQueued );
+
+        //! current batch
+        const PGresult* get() const {
+            return _res;
+        }
+
+        //! current batch, the caller takes ownership (to be freed with PQclear)
+        PGresult* release() {
+            PGresult* res = _res;
+            _res = 0;
+            return res;
+        }
+
+        //! false if an error occured
+        operator bool() const {
+            return _error.empty();
+        }
+
+        const std::string& error() const {
+            return _error;
+        }
+
+    private:
+        PostgisConnection& _conn;
+        const int _fetchSize;
+        PGresult* _res;
+        std::string _error;
+        bool _done;
+
+        // prefetching, the queue is shared with the fetching thread
+        struct Prefetcher;
+        Prefetcher* _prefetcher;
+        PGcancel* _cancel;
+        std::deque< PGresult* > _queue;
+        size_t _maxQueued;
+        bool _fetched;
+        bool _stop;
+        OpenThreads::Mutex _queueMutex;
+        OpenThreads::Condition _queueCond;
+
+        PGresult* fetch();
+        void stopPrefetch();
+        void start( const std::string& query, const std::vector< std::string >& params );
+        void clear();
+        void fail( const std::string& msg );
+        // non copyable
+        RowStream( const RowStream& );
+        RowStream operator=( const RowStream& );
+    };
+
+private:
+    PGconn* _conn;
+    std::map< std::string, std::string > _prepared; // query -> statement name
+    // non copyable
+    PostgisConnection( const PostgisConnection& );
+    PostgisConnection operator=( const PostgisConnection& );
+};
+
+//! @brief process-wide pool of connections, keyed by conn_info
+//!
+//! Tiles are loaded by the DatabasePager threads, each load borrows a connection
+//! and gives it back, this avoids the connection/authentication round trips.
+//! Connections are checked when borrowed (pinged, reconnected if broken) and when given
+//! back (closed if left in a transaction or broken). At most maxIdle() connections are
+//! kept per conn_info, the extra ones are closed when given back. At most maxActive()
+//! connections are borrowed at once per conn_info, other borrowers wait for one to be
+//! given back. The statistics are reported at the OSG_INFO notify level every 100 borrows.
+struct ConnectionPool {
+
+    static ConnectionPool& instance();
+
+    //! RAII borrowed connection, given back to the pool on destruction
+    struct Lease {
+        Lease( ConnectionPool& pool, const std::string& connInfo );
+
+        ~Lease();
+
+        PostgisConnection& operator*() {
+            return *_conn;
+        }
+
+        PostgisConnection* operator->() {
+            return _conn;
+        }
+
+    private:
+        ConnectionPool& _pool;
+        const std::string _connInfo;
+        PostgisConnection* _conn;
+        // non copyable
+        Lease( const Lease& );
+        Lease operator=( const Lease& );
+    };
+
+    struct Stats {
+        Stats()
+            : created( 0 )
+            , reused( 0 )
+            , closed( 0 )
+            , waited( 0 )
+        {}
+        unsigned long created; //!< connections opened
+        unsigned long reused;  //!< borrows served by an idle connection
+        unsigned long closed;  //!< connections closed because broken or in excess
+        unsigned long waited;  //!< borrows that waited for maxActive() to allow them
+    };
+
+    const Stats stats() const;
+
+    size_t maxIdle() const;
+
+    void setMaxIdle( size_t maxIdle );
+
+    size_t maxActive() const;
+
+    //! @param maxActive at least 1
+    void setMaxActive( size_t maxActive );
+
+    ~ConnectionPool();
+
+private:
+    mutable OpenThreads::Mutex _mutex;
+    typedef std::map< std::string, std::vector< PostgisConnection* > > IdleMap;
+    IdleMap _idle;
+    std::map< std::string, size_t > _active; // borrowed connections per conn_info
+    OpenThreads::Condition _released;
+    size_t _maxIdle;
+    size_t _maxActive;
+    Stats _stats;
+
+    ConnectionPool();
+    PostgisConnection* acquire( const std::string& connInfo );
+    void release( const std::string& connInfo, PostgisConnection* conn );
+    // non copyable
+    ConnectionPool( const ConnectionPool& );
+    ConnectionPool operator=( const ConnectionPool& );
+};
+
+//! @return the value of a numeric field in binary format (float, double, integers,
+//!         numeric, bool as 0 or 1)
+//! @throw if the column type is not supported
+double binaryNumber( const PGresult* res, int row, int column );
+
+//! @return true if the column is text (e.g. geometry cast as text is hex encoded WKB)
+bool isText( const PGresult* res, int column );
+
+//! @return true if binaryNumber() can decode the column
+bool isNumber( const PGresult* res, int column );
+
+}
+#endif
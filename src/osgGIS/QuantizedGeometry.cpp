@@ -0,0 +1,256 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "QuantizedGeometry.h"
+#include "Shaders.h"
+#include "FixedBound.h"
+
+#include <osg/Geode>
+#include <osg/MatrixTransform>
+
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+namespace osgGIS {
+
+namespace {
+// generic attribute, not aliased with gl_Normal (2) or gl_Color (3) on nvidia
+const unsigned NORMAL_ATTRIBUTE = 6;
+const float MAX_POSITION = 32767;
+const size_t MAX_VERTICES = 65536;
+
+const char* quantizedVertexSource = {
+    "#version 120\n"
+    "attribute vec2 octNormal;\n"
+    "attribute float featureId;\n"
+    "varying vec3 normal;\n"
+    "varying vec3 position;\n"
+    "varying vec4 color;\n"
+    "\n"
+    "vec4 classColor();\n"
+    "bool featureVisible( float id );\n"
+    "\n"
+    "vec3 decodeNormal( vec2 e )\n"
+    "{\n"
+    "    vec3 n = vec3( e, 1.0 - abs( e.x ) - abs( e.y ) );\n"
+    "    if ( n.z < 0.0 ) {\n"
+    "        n.xy = ( 1.0 - abs( n.yx ) ) * vec2( n.x < 0.0 ? -1.0 : 1.0, n.y < 0.0 ? -1.0 : 1.0 );\n"
+    "    }\n"
+    "    return normalize( n );\n"
+    "}\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    normal = normalize( gl_NormalMatrix * decodeNormal( octNormal / 127.0 ) );\n"
+    "    position = vec3( gl_ModelViewMatrix * gl_Vertex );\n"
+    "    color = classColor();\n"
+    "    gl_Position = featureVisible( featureId ) ? ftransform() : vec4( 2.0, 2.0, 2.0, 1.0 );\n"
+    "}\n"
+};
+
+inline
+signed char snorm8( float v )
+{
+    return static_cast< signed char >( std::floor( std::max( -1.f, std::min( 1.f, v ) ) * 127 + .5f ) );
+}
+
+inline
+short quantized( float q )
+{
+    return static_cast< short >( std::floor( std::max( -MAX_POSITION, std::min( MAX_POSITION, q ) ) + .5f ) );
+}
+
+//! octahedral encoding: the unit sphere is projected on the octahedron |x|+|y|+|z|=1,
+//! whose lower half is folded over the upper one
+inline
+const osg::Vec2b octahedral( const osg::Vec3& n )
+{
+    const float l1 = std::abs( n.x() ) + std::abs( n.y() ) + std::abs( n.z() );
+
+    if ( l1 <= 0 ) {
+        return osg::Vec2b( 0, 0 );
+    }
+
+    float x = n.x() / l1;
+    float y = n.y() / l1;
+
+    if ( n.z() < 0 ) {
+        const float fx = ( 1 - std::abs( y ) ) * ( x < 0 ? -1 : 1 );
+        const float fy = ( 1 - std::abs( x ) ) * ( y < 0 ? -1 : 1 );
+        x = fx;
+        y = fy;
+    }
+
+    return osg::Vec2b( snorm8( x ), snorm8( y ) );
+}
+
+osg::Geometry* part( osg::Vec3sArray* positions, osg::Vec2bArray* normals, osg::UIntArray* ids, osg::UIntArray* classes, osg::DrawElementsUShort* elem )
+{
+    osg::ref_ptr<osg::Geometry> geom = new osg::Geometry;
+    geom->setUseVertexBufferObjects( true );
+    geom->setVertexArray( positions );
+
+    if ( normals ) {
+        geom->setVertexAttribArray( NORMAL_ATTRIBUTE, normals );
+        geom->setVertexAttribBinding( NORMAL_ATTRIBUTE, osg::Geometry::BIND_PER_VERTEX );
+    }
+
+    if ( ids ) {
+        geom->setVertexAttribArray( FEATURE_ID_ATTRIBUTE, ids );
+        geom->setVertexAttribBinding( FEATURE_ID_ATTRIBUTE, osg::Geometry::BIND_PER_VERTEX );
+    }
+
+    if ( classes ) {
+        geom->setVertexAttribArray( CLASS_ATTRIBUTE, classes );
+        geom->setVertexAttribBinding( CLASS_ATTRIBUTE, osg::Geometry::BIND_PER_VERTEX );
+    }
+
+    geom->addPrimitiveSet( elem );
+
+    osg::BoundingBox bound;
+
+    for ( osg::Vec3sArray::const_iterator p = positions->begin(); p != positions->end(); p++ ) {
+        bound.expandBy( osg::Vec3( p->x(), p->y(), p->z() ) );
+    }
+
+    geom->setComputeBoundingBoxCallback( new FixedBound( bound ) );
+    return geom.release();
+}
+
+osg::Program* createQuantizedProgram()
+{
+    osg::ref_ptr<osg::Program> program = new osg::Program;
+    program->addShader( new osg::Shader( osg::Shader::VERTEX, quantizedVertexSource ) );
+    program->addShader( new osg::Shader( osg::Shader::VERTEX, CLASS_COLOR_VERTEX_SOURCE ) );
+    program->addShader( new osg::Shader( osg::Shader::VERTEX, FEATURE_FILTER_VERTEX_SOURCE ) );
+    program->addShader( new osg::Shader( osg::Shader::FRAGMENT, SMOOTH_FRAGMENT_SOURCE ) );
+    program->addShader( new osg::Shader( osg::Shader::FRAGMENT, LIGHTING_FRAGMENT_SOURCE ) );
+    program->addBindAttribLocation( "octNormal", NORMAL_ATTRIBUTE );
+    program->addBindAttribLocation( "featureClass", CLASS_ATTRIBUTE );
+    program->addBindAttribLocation( "featureId", FEATURE_ID_ATTRIBUTE );
+    return program.release();
+}
+}
+
+osg::Program* quantizedProgram()
+{
+    static const osg::ref_ptr<osg::Program> program( createQuantizedProgram() );
+    return program.get();
+}
+
+osg::Node* quantize( const osg::Geometry& geometry )
+{
+    const osg::Vec3Array* vtx = dynamic_cast< const osg::Vec3Array* >( geometry.getVertexArray() );
+    const osg::Vec3Array* nrml = dynamic_cast< const osg::Vec3Array* >( geometry.getNormalArray() );
+    const osg::UIntArray* fid = dynamic_cast< const osg::UIntArray* >( geometry.getVertexAttribArray( FEATURE_ID_ATTRIBUTE ) );
+    const osg::UIntArray* cls = dynamic_cast< const osg::UIntArray* >( geometry.getVertexAttribArray( CLASS_ATTRIBUTE ) );
+    const osg::DrawElementsUInt* tri = geometry.getNumPrimitiveSets() == 1
+                                       ? dynamic_cast< const osg::DrawElementsUInt* >( geometry.getPrimitiveSet( 0 ) )
+                                       : 0;
+
+    if ( !vtx || ( nrml && nrml->size() != vtx->size() ) || ( fid && fid->size() != vtx->size() )
+            || ( cls && cls->size() != vtx->size() )
+            || !tri || tri->getMode() != GL_TRIANGLES ) {
+        throw std::runtime_error( "cannot quantize geometry, indexed triangles with per vertex or no normals, ids and classes expected" );
+    }
+
+    osg::BoundingBox bbox;
+
+    for ( osg::Vec3Array::const_iterator v = vtx->begin(); v != vtx->end(); v++ ) {
+        bbox.expandBy( *v );
+    }
+
+    const osg::Vec3 center = bbox.valid() ? bbox.center() : osg::Vec3();
+    const float halfExtent = bbox.valid()
+                             ? .5f * std::max( bbox.xMax() - bbox.xMin(), std::max( bbox.yMax() - bbox.yMin(), bbox.zMax() - bbox.zMin() ) )
+                             : 0;
+    const float step = halfExtent > 0 ? halfExtent / MAX_POSITION : 1;
+
+    osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+
+    // vertices are copied in the part of the first triangle using them, and again
+    // in later parts if needed
+    std::vector< unsigned > vertexPart( vtx->size(), 0 );
+    std::vector< unsigned short > local( vtx->size() );
+    unsigned numParts = 0;
+
+    osg::ref_ptr<osg::Vec3sArray> positions;
+    osg::ref_ptr<osg::Vec2bArray> normals;
+    osg::ref_ptr<osg::UIntArray> ids;
+    osg::ref_ptr<osg::UIntArray> classes;
+    osg::ref_ptr<osg::DrawElementsUShort> elem;
+
+    for ( size_t t = 0; t + 2 < tri->size(); t += 3 ) {
+        if ( !elem.valid() || positions->size() + 3 > MAX_VERTICES ) {
+            if ( elem.valid() ) {
+                geode->addDrawable( part( positions.get(), normals.get(), ids.get(), classes.get(), elem.get() ) );
+            }
+
+            positions = new osg::Vec3sArray;
+            normals = nrml ? new osg::Vec2bArray : 0;
+            ids = fid ? new osg::UIntArray : 0;
+            classes = cls ? new osg::UIntArray : 0;
+            elem = new osg::DrawElementsUShort( GL_TRIANGLES );
+            numParts++;
+        }
+
+        for ( size_t c = t; c < t + 3; c++ ) {
+            const unsigned i = ( *tri )[c];
+
+            if ( vertexPart[i] != numParts ) {
+                vertexPart[i] = numParts;
+                local[i] = positions->size();
+                const osg::Vec3 q = ( ( *vtx )[i] - center ) / step;
+                positions->push_back( osg::Vec3s( quantized( q.x() ), quantized( q.y() ), quantized( q.z() ) ) );
+
+                if ( nrml ) {
+                    normals->push_back( octahedral( ( *nrml )[i] ) );
+                }
+
+                if ( fid ) {
+                    ids->push_back( ( *fid )[i] );
+                }
+
+                if ( cls ) {
+                    classes->push_back( ( *cls )[i] );
+                }
+            }
+
+            elem->push_back( local[i] );
+        }
+    }
+
+    if ( elem.valid() ) {
+        geode->addDrawable( part( positions.get(), normals.get(), ids.get(), classes.get(), elem.get() ) );
+    }
+
+    // without normals, the flat shading program of the layer applies
+    if ( nrml ) {
+        osg::StateSet* stateset = geode->getOrCreateStateSet();
+        stateset->setAttributeAndModes( quantizedProgram() );
+        stateset->addUniform( new osg::Uniform( "visibility", int( VISIBILITY_TEXTURE_UNIT ) ) );
+    }
+
+    osg::ref_ptr<osg::MatrixTransform> transform =
+        new osg::MatrixTransform( osg::Matrix::scale( step, step, step ) * osg::Matrix::translate( center ) );
+    transform->addChild( geode.get() );
+    return transform.release();
+}
+
+}
@@ -0,0 +1,44 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STACK3D_OSGGIS_QUANTIZEDGEOMETRY
+#define STACK3D_OSGGIS_QUANTIZEDGEOMETRY
+
+#include <osg/Geometry>
+#include <osg/Program>
+
+namespace osgGIS {
+
+//! @brief compact copy of a tile geometry, about 3 times smaller
+//!
+//! Positions are stored as 16 bit integers relative to the center of the bounding box
+//! and dequantized by the returned transform; its scale is uniform, so normals keep their
+//! direction. Normals are octahedral encoded in two bytes and decoded by the vertex
+//! shader of quantizedProgram(), that lights with the material of the state set.
+//! Indices are 16 bit, the geometry is split in several drawables beyond 65536 vertices.
+//! Geometries without normals (flat shading) get neither normals nor program.
+//!
+//! @param geometry indexed GL_TRIANGLES with per vertex or no normals, as built by Mesh
+//! @throw std::runtime_error if the geometry has another layout
+osg::Node* quantize( const osg::Geometry& geometry );
+
+//! @brief decodes normals of quantized geometries, shared by all tiles of both plugins
+osg::Program* quantizedProgram();
+
+}
+#endif
@@ -17,6 +17,8 @@
  *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 #include "StringUtils.h"
+#include "DatasetPool.h"
+#include "QuantizedGeometry.h"
 
 #include <osgDB/FileNameUtils>
 #include <osgDB/ReaderWriter>
@@ -38,38 +40,87 @@
 #define DEBUG_OUT if (0) std::cerr
 #define ERROR (std::cerr << "error: ")
 
-void MyErrorHandler( CPLErr , int /*err_no*/, const char* msg )
+//! indexed triangles of the height field and of its skirt, the layout osgGIS::quantize expects
+inline
+osg::Geometry* heightFieldGeometry( const osg::HeightField& hf )
 {
-    ERROR << "from GDAL:" << msg << "\n";
-}
+    const unsigned w = hf.getNumColumns();
+    const unsigned h = hf.getNumRows();
 
-struct ReaderWriterMNT : osgDB::ReaderWriter {
+    osg::ref_ptr<osg::Vec3Array> vtx = new osg::Vec3Array;
+    osg::ref_ptr<osg::Vec3Array> nrml = new osg::Vec3Array;
+    osg::ref_ptr<osg::DrawElementsUInt> tri = new osg::DrawElementsUInt( GL_TRIANGLES );
 
-    // for GDAL RAII
-    struct Dataset {
-        Dataset( const std::string& file )
-            : _raster( ( GDALDataset* ) GDALOpen( file.c_str(), GA_ReadOnly ) )
-        {}
+    for ( unsigned r = 0; r < h; r++ ) {
+        for ( unsigned c = 0; c < w; c++ ) {
+            vtx->push_back( hf.getVertex( c, r ) );
+            nrml->push_back( hf.getNormal( c, r ) );
+        }
+    }
 
-        GDALDataset* operator->() {
-            return _raster;
+    for ( unsigned r = 0; r + 1 < h; r++ ) {
+        for ( unsigned c = 0; c + 1 < w; c++ ) {
+            const unsigned i = r*w + c;
+            tri->push_back( i );
+            tri->push_back( i + 1 );
+            tri->push_back( i + w + 1 );
+            tri->push_back( i );
+            tri->push_back( i + w + 1 );
+            tri->push_back( i + w );
         }
-        operator bool() {
-            return _raster;
+    }
+
+    // the skirt hides cracks between tiles of different levels, the border is walked
+    // counterclockwise and lowered
+    if ( w > 1 && h > 1 && hf.getSkirtHeight() > 0 ) {
+        std::vector< unsigned > border;
+
+        for ( unsigned c = 0; c < w - 1; c++ ) {
+            border.push_back( c );
         }
 
-        ~Dataset() {
-            if ( _raster ) {
-                GDALClose( _raster );
-            }
+        for ( unsigned r = 0; r < h - 1; r++ ) {
+            border.push_back( r*w + w - 1 );
         }
-    private:
-        GDALDataset* _raster;
-    };
+
+        for ( unsigned c = w - 1; c > 0; c-- ) {
+            border.push_back( ( h - 1 )*w + c );
+        }
+
+        for ( unsigned r = h - 1; r > 0; r-- ) {
+            border.push_back( r*w );
+        }
+
+        const unsigned lowered = vtx->size();
+
+        for ( size_t b = 0; b < border.size(); b++ ) {
+            vtx->push_back( ( *vtx )[ border[b] ] - osg::Vec3( 0, 0, hf.getSkirtHeight() ) );
+            nrml->push_back( ( *nrml )[ border[b] ] );
+        }
+
+        for ( size_t b = 0; b < border.size(); b++ ) {
+            const size_t next = ( b + 1 ) % border.size();
+            tri->push_back( border[b] );
+            tri->push_back( lowered + b );
+            tri->push_back( border[next] );
+            tri->push_back( border[next] );
+            tri->push_back( lowered + b );
+            tri->push_back( lowered + next );
+        }
+    }
+
+    osg::ref_ptr<osg::Geometry> geom = new osg::Geometry;
+    geom->setVertexArray( vtx.get() );
+    geom->setNormalArray( nrml.get() );
+    geom->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+    geom->addPrimitiveSet( tri.get() );
+    return geom.release();
+}
+
+struct ReaderWriterMNT : osgDB::ReaderWriter {
 
     ReaderWriterMNT() {
         GDALAllRegister();
-        CPLSetErrorHandler( MyErrorHandler );
 
         supportsExtension( "mnt", "MNT tif loader" );
         supportsExtension( "mntd", "MNT tif loader" );
@@ -136,7 +187,20 @@ struct ReaderWriterMNT : osgDB::ReaderWriter {
             return ReadResult::ERROR_IN_READING_FILE;
         }
 
-        Dataset raster( am.value( "file" ).c_str() );
+        // 16 bit positions and indices, 2 bytes normals
+        int quantize = 0;
+
+        if ( !am.optionalValue( "quantize" ).empty()
+                && !( std::istringstream( am.value( "quantize" ) ) >> quantize ) ) {
+            ERROR << "cannot parse quantize=\"" << am.value( "quantize" ) << "\"\n";
+            return ReadResult::ERROR_IN_READING_FILE;
+        }
+
+        // errors are reported, the tile is loaded anyway
+        osgGIS::GdalErrorScope gdalErrors;
+
+        // the raster stays opened from one tile to the next
+        osgGIS::DatasetPool::Handle raster( osgGIS::DatasetPool::instance(), am.value( "file" ) );
 
         if ( ! raster ) {
             ERROR << "cannot open dataset from file=\"" << am.value( "file" ) << "\"\n";
@@ -257,12 +321,21 @@ struct ReaderWriterMNT : osgDB::ReaderWriter {
             }
         }
 
+        if ( !gdalErrors.error().empty() ) {
+            ERROR << "from GDAL:" << gdalErrors.error() << "\n";
+        }
+
         DEBUG_OUT << "zMax=" << zMax << "\n";
 
         hf->setSkirtHeight( ( xmax-xmin )/10 );
 
         DEBUG_OUT << "loaded in " << timer.time_s() << "sec\n";
 
+        if ( quantize ) {
+            osg::ref_ptr<osg::Geometry> geom = heightFieldGeometry( *hf );
+            return osgGIS::quantize( *geom );
+        }
+
         osg::Geode* geode = new osg::Geode;
         geode->addDrawable( new osg::ShapeDrawable( hf.get() ) );
         return geode;
@@ -17,7 +17,15 @@
  *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 #include "SFosg.h"
+#include "PostgisConnection.h"
+#include "ElevationSampler.h"
+#include "DatasetPool.h"
+#include "QuantizedGeometry.h"
+#include "InstancedBars.h"
+#include "InstancedModels.h"
+#include "Ribbons.h"
 #include "StringUtils.h"
+#include "AttributeTable.h"
 
 #include <osgDB/FileNameUtils>
 #include <osgDB/ReaderWriter>
@@ -25,101 +33,464 @@
 #include <osgDB/ReadFile>
 #include <osg/ShapeDrawable>
 #include <osg/MatrixTransform>
+#include <osg/KdTree>
+#include <osg/Notify>
 #include <osgUtil/Optimizer>
 
+#include <OpenThreads/Thread>
+#include <OpenThreads/Condition>
+#include <OpenThreads/ScopedLock>
+
 #include <sstream>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include <cmath>
 #include <cassert>
 
 #include <gdal_priv.h>
 #include <cpl_conv.h>
 
-#include <libpq-fe.h>
-
 #define DEBUG_OUT if (0) std::cerr
 
-//! for GDAL RAII
-struct Dataset {
-    Dataset( const std::string& file )
-        : _raster( ( GDALDataset* ) GDALOpen( file.c_str(), GA_ReadOnly ) )
+//! converts the rows of result batches, columns are looked up in the first batch
+//!
+//! With a 'height' column, the geometries are footprints extruded from the
+//! optional 'base' column (0 if absent or null) to base + height.
+//! Bars are either added to the mesh as boxes, or recorded as instances.
+//! For model layers, the geometries are points where a model is placed, scaled by
+//! the optional 'scale' column and turned by the 'rotation' one (degrees).
+//! With an id column, mesh and line vertices and instances are tagged with the id of
+//! their feature, and mesh vertices with the class index of their feature with a
+//! class column.
+struct FeatureConverter {
+    FeatureConverter( const PGresult* res, const std::string& geocolumn, const std::string& idcolumn,
+                      const std::string& classcolumn, bool instancedBars, bool models )
+        : _instancedBars( instancedBars )
+        , _models( models )
+        , _geomIdx( PQfnumber( res,  geocolumn.c_str() ) )
+        , _idIdx( idcolumn.empty() ? -1 : PQfnumber( res,  idcolumn.c_str() ) )
+        , _classIdx( classcolumn.empty() ? -1 : PQfnumber( res,  classcolumn.c_str() ) )
+        , _posIdx( PQfnumber( res,  "pos" ) )
+        , _heightIdx( PQfnumber( res,  "height" ) )
+        , _widthIdx( PQfnumber( res,  "width" ) )
+        , _baseIdx( PQfnumber( res,  "base" ) )
+        , _scaleIdx( PQfnumber( res,  "scale" ) )
+        , _rotationIdx( PQfnumber( res,  "rotation" ) )
+        , _badClassWarned( false )
     {}
 
-    GDALDataset* operator->() {
-        return _raster;
+    //! false if there is neither a geometry column nor the bar columns, model layers need the geometry
+    bool valid() const {
+        return _geomIdx >= 0 || ( !_models && _posIdx >= 0 && _heightIdx >= 0 && _widthIdx >= 0 );
     }
-    operator bool() {
-        return _raster;
+
+    //! false if an id column is given but not found
+    bool hasIdColumn() const {
+        return _idIdx >= 0;
+    }
+
+    //! false if a class column is given but not found
+    bool hasClassColumn() const {
+        return _classIdx >= 0;
     }
 
-    ~Dataset() {
-        if ( _raster ) {
-            GDALClose( _raster );
+    //! footprints are extruded or bars are drawn, vertex heights are relative to the ground
+    bool extruded() const {
+        return _heightIdx >= 0 && !_models;
+    }
+
+    void operator()( const PGresult* res, osgGIS::Mesh& mesh ) const {
+        const int numRows = PQntuples( res );
+
+        if ( _models ) {
+            const bool hex = osgGIS::isText( res, _geomIdx );
+
+            for( int i=0; i<numRows; i++ ) {
+                if ( PQgetisnull( res, i, _geomIdx ) ) {
+                    continue;
+                }
+
+                if ( _idIdx >= 0 ) {
+                    mesh.setFeatureId( PQgetisnull( res, i, _idIdx ) ? 0 : unsigned( osgGIS::binaryNumber( res, i, _idIdx ) ) );
+                }
+
+                const float scale = _scaleIdx >= 0 && !PQgetisnull( res, i, _scaleIdx ) ? osgGIS::binaryNumber( res, i, _scaleIdx ) : 1;
+                const float rotation = _rotationIdx >= 0 && !PQgetisnull( res, i, _rotationIdx ) ? osgGIS::binaryNumber( res, i, _rotationIdx ) : 0;
+
+                if ( hex ) {
+                    mesh.addModelInstances( osgGIS::WKB( PQgetvalue( res, i, _geomIdx ) ), scale, rotation );
+                }
+                else {
+                    mesh.addModelInstances( osgGIS::BinaryWKB( PQgetvalue( res, i, _geomIdx ), PQgetlength( res, i, _geomIdx ) ), scale, rotation );
+                }
+            }
+        }
+        else if ( _geomIdx >= 0 ) { // we have a geom column, we create the model from it
+            const bool hex = osgGIS::isText( res, _geomIdx );
+            const bool extrude = extruded();
+
+            // room for the whole batch, the headers are cheap to read
+            size_t numVertices = 0;
+            size_t numIndices = 0;
+
+            for( int i=0; i<numRows; i++ ) {
+                if ( PQgetisnull( res, i, _geomIdx ) ) {
+                    continue;
+                }
+
+                if ( hex ) {
+                    osgGIS::Mesh::estimate( osgGIS::WKB( PQgetvalue( res, i, _geomIdx ) ), numVertices, numIndices, extrude );
+                }
+                else {
+                    osgGIS::Mesh::estimate( osgGIS::BinaryWKB( PQgetvalue( res, i, _geomIdx ), PQgetlength( res, i, _geomIdx ) ), numVertices, numIndices, extrude );
+                }
+            }
+
+            mesh.reserve( numVertices, numIndices );
+
+            for( int i=0; i<numRows; i++ ) {
+                if ( PQgetisnull( res, i, _geomIdx ) ) {
+                    continue;
+                }
+
+                if ( _idIdx >= 0 ) {
+                    mesh.setFeatureId( PQgetisnull( res, i, _idIdx ) ? 0 : unsigned( osgGIS::binaryNumber( res, i, _idIdx ) ) );
+                }
+
+                if ( _classIdx >= 0 ) {
+                    mesh.setFeatureClass( featureClass( res, i ) );
+                }
+
+                if ( extrude && !PQgetisnull( res, i, _heightIdx ) ) {
+                    const float h = osgGIS::binaryNumber( res, i, _heightIdx );
+                    const float base = _baseIdx >= 0 && !PQgetisnull( res, i, _baseIdx ) ? osgGIS::binaryNumber( res, i, _baseIdx ) : 0;
+
+                    if ( hex ) {
+                        mesh.extrude( osgGIS::WKB( PQgetvalue( res, i, _geomIdx ) ), base, h );
+                    }
+                    else {
+                        mesh.extrude( osgGIS::BinaryWKB( PQgetvalue( res, i, _geomIdx ), PQgetlength( res, i, _geomIdx ) ), base, h );
+                    }
+                }
+                else if ( hex ) {
+                    mesh.push_back( osgGIS::WKB( PQgetvalue( res, i, _geomIdx ) ) );
+                }
+                else {
+                    mesh.push_back( osgGIS::BinaryWKB( PQgetvalue( res, i, _geomIdx ), PQgetlength( res, i, _geomIdx ) ) );
+                }
+            }
+        }
+        else { // we draw bars instead of geom
+            const bool hex = osgGIS::isText( res, _posIdx );
+
+            if ( !_instancedBars ) {
+                mesh.reserve( numRows * osgGIS::Mesh::BAR_VERTICES, numRows * osgGIS::Mesh::BAR_INDICES );
+            }
+
+            for( int i=0; i<numRows; i++ ) {
+                if ( PQgetisnull( res, i, _posIdx ) || PQgetisnull( res, i, _heightIdx ) || PQgetisnull( res, i, _widthIdx ) ) {
+                    continue;
+                }
+
+                const float h = osgGIS::binaryNumber( res, i, _heightIdx );
+                const float w = osgGIS::binaryNumber( res, i, _widthIdx );
+
+                if ( _idIdx >= 0 ) {
+                    mesh.setFeatureId( PQgetisnull( res, i, _idIdx ) ? 0 : unsigned( osgGIS::binaryNumber( res, i, _idIdx ) ) );
+                }
+
+                if ( _classIdx >= 0 ) {
+                    mesh.setFeatureClass( featureClass( res, i ) );
+                }
+
+                if ( _instancedBars && hex ) {
+                    mesh.addBarInstance( osgGIS::WKB( PQgetvalue( res, i, _posIdx ) ), w, h );
+                }
+                else if ( _instancedBars ) {
+                    mesh.addBarInstance( osgGIS::BinaryWKB( PQgetvalue( res, i, _posIdx ), PQgetlength( res, i, _posIdx ) ), w, h );
+                }
+                else if ( hex ) {
+                    mesh.addBar( osgGIS::WKB( PQgetvalue( res, i, _posIdx ) ), w, w, h );
+                }
+                else {
+                    mesh.addBar( osgGIS::BinaryWKB( PQgetvalue( res, i, _posIdx ), PQgetlength( res, i, _posIdx ) ), w, w, h );
+                }
+            }
         }
     }
+
 private:
-    GDALDataset* _raster;
+    //! class index of row i, 0 if null, negative, NaN or too large for an unsigned
+    unsigned featureClass( const PGresult* res, int i ) const {
+        if ( PQgetisnull( res, i, _classIdx ) ) {
+            return 0;
+        }
+
+        const double value = osgGIS::binaryNumber( res, i, _classIdx );
+
+        if ( !( value >= 0 && value <= double( std::numeric_limits< unsigned >::max() ) ) ) {
+            if ( !_badClassWarned ) {
+                std::cerr << "warning: class column value " << value << " is not a class index, class 0 is used\n";
+                _badClassWarned = true;
+            }
+
+            return 0;
+        }
+
+        return unsigned( value );
+    }
+
+    const bool _instancedBars;
+    const bool _models;
+    const int _geomIdx;
+    const int _idIdx;
+    const int _classIdx;
+    const int _posIdx;
+    const int _heightIdx;
+    const int _widthIdx;
+    const int _baseIdx;
+    const int _scaleIdx;
+    const int _rotationIdx;
+    mutable bool _badClassWarned;
 };
 
-//! for postgres connection RAII
-struct PostgisConnection {
+//! adds the rows of a batch to table, column is the index of the table column
+//! i in the batch, rows without id are skipped
+inline
+void readAttributes( const PGresult* res, int idIdx, const std::vector< int >& column, osgGIS::AttributeTable& table )
+{
+    for ( int i = 0; i < PQntuples( res ); i++ ) {
+        if ( PQgetisnull( res, i, idIdx ) ) {
+            continue;
+        }
+
+        table.addRow( unsigned( osgGIS::binaryNumber( res, i, idIdx ) ) );
 
-    PostgisConnection( const std::string& connInfo )
-        : _conn( PQconnectdb( connInfo.c_str() ) )
-    {}
+        for ( size_t c = 0; c < column.size(); c++ ) {
+            if ( PQgetisnull( res, i, column[c] ) ) {
+                continue;
+            }
 
-    operator bool() {
-        return CONNECTION_OK == PQstatus( _conn );
+            if ( table.type( c ) == osgGIS::AttributeTable::STRING ) {
+                table.setString( c, std::string( PQgetvalue( res, i, column[c] ), PQgetlength( res, i, column[c] ) ) );
+            }
+            else {
+                table.setNumber( c, osgGIS::binaryNumber( res, i, column[c] ) );
+            }
+        }
     }
+}
 
-    ~PostgisConnection() {
-        if ( _conn ) {
-            PQfinish( _conn );
+//! attaches the attributes of the tile, if any, to its node
+inline
+osg::Node* withAttributes( osg::Node* node, osgGIS::AttributeTable* table )
+{
+    if ( table ) {
+        node->setUserData( table );
+    }
+
+    return node;
+}
+
+//! @brief converts result batches on several threads
+//!
+//! Consecutive batches are grouped in chunks, each chunk is converted into its own
+//! mesh by the first available thread. Meshes are appended in chunk order, the result
+//! does not depend on thread scheduling.
+struct ParallelConverter {
+    ParallelConverter( const FeatureConverter& convert, const osg::Matrixd& layerToWord, bool withNormals, double arcTolerance, int numThreads )
+        : _convert( convert )
+        , _layerToWord( layerToWord )
+        , _withNormals( withNormals )
+        , _arcTolerance( arcTolerance )
+        , _filling( 0 )
+        , _fillingRows( 0 )
+        , _next( 0 )
+        , _closed( false )
+        , _abort( false ) {
+        for ( int t = 0; t < numThreads; t++ ) {
+            _workers.push_back( new Worker( *this ) );
+            _workers.back()->startThread();
         }
     }
 
-    // for RAII ok query results
-    struct QueryResult {
-        QueryResult( PostgisConnection& conn, const std::string& query )
-            : _res( PQexec( conn._conn, query.c_str() ) )
-            , _error( PQresultErrorMessage( _res ) )
-        {}
+    ~ParallelConverter() {
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+            _abort = true;
+            _closed = true;
+            _cond.broadcast();
+        }
+
+        join();
 
-        ~QueryResult() {
-            PQclear( _res );
+        if ( _filling ) {
+            _chunks.push_back( _filling );
         }
 
-        operator bool() const {
-            return _error.empty();
+        for ( std::vector< Chunk* >::iterator c = _chunks.begin(); c != _chunks.end(); c++ ) {
+            for ( std::vector< PGresult* >::iterator b = ( *c )->batches.begin(); b != ( *c )->batches.end(); b++ ) {
+                PQclear( *b );
+            }
+
+            delete ( *c )->mesh;
+            delete *c;
         }
+    }
 
-        PGresult* get() {
-            return _res;
+    //! takes ownership of the batch
+    void push_back( PGresult* batch ) {
+        if ( !_filling ) {
+            _filling = new Chunk( _layerToWord, _withNormals, _arcTolerance );
+            _fillingRows = 0;
         }
 
-        const std::string& error() const {
-            return _error;
+        _filling->batches.push_back( batch );
+        _fillingRows += PQntuples( batch );
+
+        if ( _fillingRows >= CHUNK_ROWS ) {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+            _chunks.push_back( _filling );
+            _filling = 0;
+            _cond.broadcast();
+        }
+    }
+
+    //! waits for the conversion and appends the meshes in order
+    //! @throw the first conversion error
+    void finish( osgGIS::Mesh& mesh ) {
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+
+            if ( _filling ) {
+                _chunks.push_back( _filling );
+                _filling = 0;
+            }
+
+            _closed = true;
+            _cond.broadcast();
+        }
+
+        join();
+
+        if ( !_error.empty() ) {
+            throw std::runtime_error( _error );
+        }
+
+        size_t numVertices = 0;
+        size_t numIndices = 0;
+
+        for ( std::vector< Chunk* >::iterator c = _chunks.begin(); c != _chunks.end(); c++ ) {
+            numVertices += ( *c )->mesh->numVertices();
+            numIndices += ( *c )->mesh->numIndices();
+        }
+
+        mesh.reserve( numVertices, numIndices );
+
+        // chunk meshes are freed as soon as appended to limit the peak memory
+        for ( std::vector< Chunk* >::iterator c = _chunks.begin(); c != _chunks.end(); c++ ) {
+            mesh.append( *( *c )->mesh );
+            delete ( *c )->mesh;
+            ( *c )->mesh = 0;
+        }
+    }
+
+private:
+    // enough work per chunk to make the synchronisation negligible
+    static const int CHUNK_ROWS = 256;
+
+    struct Chunk {
+        Chunk( const osg::Matrixd& layerToWord, bool withNormals, double arcTolerance )
+            : mesh( new osgGIS::Mesh( layerToWord, withNormals, arcTolerance ) )
+        {}
+        std::vector< PGresult* > batches;
+        osgGIS::Mesh* mesh;
+    };
+
+    struct Worker : OpenThreads::Thread {
+        Worker( ParallelConverter& converter )
+            : _converter( converter )
+        {}
+
+        void run() {
+            _converter.work();
         }
 
     private:
-        PGresult* _res;
-        const std::string _error;
-        // non copyable
-        QueryResult( const QueryResult& );
-        QueryResult operator=( const QueryResult& );
+        ParallelConverter& _converter;
     };
 
-private:
-    PGconn* _conn;
-};
+    const FeatureConverter& _convert;
+    const osg::Matrixd _layerToWord;
+    const bool _withNormals;
+    const double _arcTolerance;
+    std::vector< Worker* > _workers;
+    std::vector< Chunk* > _chunks; // ready for conversion
+    Chunk* _filling;
+    int _fillingRows;
+    size_t _next; // next chunk to convert
+    bool _closed;
+    bool _abort;
+    std::string _error;
+    OpenThreads::Mutex _mutex;
+    OpenThreads::Condition _cond;
+
+    void work() {
+        for ( ;; ) {
+            Chunk* chunk;
+            {
+                OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+
+                while ( _next >= _chunks.size() && !_closed ) {
+                    _cond.wait( &_mutex );
+                }
 
-void MyErrorHandler( CPLErr , int /*err_no*/, const char* msg )
-{
-    throw std::runtime_error( std::string( "from GDAL: " ) + msg );
-}
+                if ( _abort || _next >= _chunks.size() ) {
+                    return;
+                }
+
+                chunk = _chunks[ _next++ ];
+            }
+
+            try {
+                for ( std::vector< PGresult* >::iterator b = chunk->batches.begin(); b != chunk->batches.end(); b++ ) {
+                    _convert( *b, *chunk->mesh );
+                }
+            }
+            catch ( std::exception& e ) {
+                OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+
+                if ( _error.empty() ) {
+                    _error = e.what();
+                }
+            }
+
+            for ( std::vector< PGresult* >::iterator b = chunk->batches.begin(); b != chunk->batches.end(); b++ ) {
+                PQclear( *b );
+            }
+
+            chunk->batches.clear();
+        }
+    }
+
+    void join() {
+        for ( std::vector< Worker* >::iterator w = _workers.begin(); w != _workers.end(); w++ ) {
+            ( *w )->join();
+            delete *w;
+        }
+
+        _workers.clear();
+    }
+
+    // non copyable
+    ParallelConverter( const ParallelConverter& );
+    ParallelConverter operator=( const ParallelConverter& );
+};
 
 struct ReaderWriterPOSTGIS : osgDB::ReaderWriter {
     ReaderWriterPOSTGIS() {
         GDALAllRegister();
-        CPLSetErrorHandler( MyErrorHandler );
         supportsExtension( "postgis", "PostGIS feature loader" );
         supportsExtension( "postgisd", "PostGIS feature loader" );
     }
@@ -150,146 +521,435 @@ struct ReaderWriterPOSTGIS : osgDB::ReaderWriter {
         std::stringstream line( file_name );
         AttributeMap am( line );
 
-        PostgisConnection conn( am.value( "conn_info" ) );
+        // connections are reused from one tile to the next
+        osgGIS::ConnectionPool::Lease conn( osgGIS::ConnectionPool::instance(), am.value( "conn_info" ) );
 
-        if ( !conn ) {
+        if ( !*conn ) {
             std::cerr << "failed to open database with conn_info=\"" << am.value( "conn_info" ) << "\"\n";
             return ReadResult::FILE_NOT_FOUND;
         }
 
         DEBUG_OUT << "connected in " <<  timer.time_s() << "sec\n";
 
-        DEBUG_OUT << "execute request...\n";
-        timer.setStartTick();
+        // define transfo  layerToWord
+        osg::Matrixd layerToWord;
+
+        osg::Vec3d origin;
+
+        {
+            if ( !( std::stringstream( am.value( "origin" ) ) >> origin.x() >> origin.y() >> origin.z() ) ) {
+                std::cerr << "failed to obtain origin=\""<< am.value( "origin" ) <<"\"\n";
+                return ReadResult::ERROR_IN_READING_FILE;
+            }
 
-        PostgisConnection::QueryResult res( conn, am.value( "query" ).c_str() );
+            layerToWord.makeTranslate( -origin );
+        }
+
+        // rows are fetched one at a time, or fetch_size at a time from a cursor
+        int fetchSize = 0;
 
-        if ( !res ) {
-            std::cerr << "failed to execute query=\"" <<  am.value( "query" ) << "\" : " << res.error() << "\n";
+        if ( !am.optionalValue( "fetch_size" ).empty()
+                && !( std::stringstream( am.value( "fetch_size" ) ) >> fetchSize ) ) {
+            std::cerr << "failed to obtain fetch_size=\""<< am.value( "fetch_size" ) <<"\"\n";
             return ReadResult::ERROR_IN_READING_FILE;
         }
 
-        const int numFeatures = PQntuples( res.get() );
+        // batches fetched in the background while the current one is converted, 0 for none
+        int prefetch = 0;
 
-        DEBUG_OUT << "got " << numFeatures << " features in " << timer.time_s() << "sec\n";
+        if ( !am.optionalValue( "prefetch" ).empty()
+                && !( std::stringstream( am.value( "prefetch" ) ) >> prefetch ) ) {
+            std::cerr << "failed to obtain prefetch=\""<< am.value( "prefetch" ) <<"\"\n";
+            return ReadResult::ERROR_IN_READING_FILE;
+        }
 
-        DEBUG_OUT << "converting " << numFeatures << " features from postgis...\n";
+        // 16 bit positions and indices, 2 bytes normals
+        int quantize = 0;
 
-        timer.setStartTick();
+        if ( !am.optionalValue( "quantize" ).empty()
+                && !( std::stringstream( am.value( "quantize" ) ) >> quantize ) ) {
+            std::cerr << "failed to obtain quantize=\""<< am.value( "quantize" ) <<"\"\n";
+            return ReadResult::ERROR_IN_READING_FILE;
+        }
 
-        // define transfo  layerToWord
-        osg::Matrixd layerToWord;
+        // flat shaded layers have no normal array, see osgGIS/Shaders.h
+        const std::string shading = am.optionalValue( "shading" );
 
-        osg::Vec3d origin;
+        if ( !shading.empty() && shading != "smooth" && shading != "flat" ) {
+            std::cerr << "failed to obtain shading=\""<< shading <<"\", smooth or flat expected\n";
+            return ReadResult::ERROR_IN_READING_FILE;
+        }
 
-        {
-            if ( !( std::stringstream( am.value( "origin" ) ) >> origin.x() >> origin.y() >> origin.z() ) ) {
-                std::cerr << "failed to obtain origin=\""<< am.value( "origin" ) <<"\"\n";
-                return ReadResult::ERROR_IN_READING_FILE;
+        const bool withNormals = shading != "flat";
+
+        // bars drawn by instancing, see osgGIS/InstancedBars.h
+        int instanced = 0;
+
+        if ( !am.optionalValue( "instanced" ).empty()
+                && !( std::stringstream( am.value( "instanced" ) ) >> instanced ) ) {
+            std::cerr << "failed to obtain instanced=\""<< am.value( "instanced" ) <<"\"\n";
+            return ReadResult::ERROR_IN_READING_FILE;
+        }
+
+        // linestrings are drawn as ribbons of line_width pixels, as GL_LINES without it
+        float lineWidth = 0;
+
+        if ( !am.optionalValue( "line_width" ).empty()
+                && !( std::stringstream( am.value( "line_width" ) ) >> lineWidth ) ) {
+            std::cerr << "failed to obtain line_width=\""<< am.value( "line_width" ) <<"\"\n";
+            return ReadResult::ERROR_IN_READING_FILE;
+        }
+
+        // curves are linearized within arc_tolerance (layer units), finest without it
+        double arcTolerance = 0;
+
+        if ( !am.optionalValue( "arc_tolerance" ).empty()
+                && !( std::stringstream( am.value( "arc_tolerance" ) ) >> arcTolerance ) ) {
+            std::cerr << "failed to obtain arc_tolerance=\""<< am.value( "arc_tolerance" ) <<"\"\n";
+            return ReadResult::ERROR_IN_READING_FILE;
+        }
+
+        // point layer, a model (file or osgGIS::BUILTIN_CONE) is placed at each point,
+        // see osgGIS/InstancedModels.h
+        const std::string model = am.optionalValue( "model" );
+        const bool models = !model.empty();
+
+        // features are converted on several threads if threads > 1
+        int numThreads = 1;
+
+        if ( !am.optionalValue( "threads" ).empty()
+                && !( std::stringstream( am.value( "threads" ) ) >> numThreads ) ) {
+            std::cerr << "failed to obtain threads=\""<< am.value( "threads" ) <<"\"\n";
+            return ReadResult::ERROR_IN_READING_FILE;
+        }
+
+        // tile envelope, bound to the parameters $1 to $4 of the prepared query
+        std::vector< std::string > tile;
+
+        if ( !am.optionalValue( "tile" ).empty() ) {
+            std::stringstream envelope( am.value( "tile" ) );
+            std::string v;
+
+            while ( envelope >> v ) {
+                tile.push_back( v );
             }
 
-            layerToWord.makeTranslate( -origin );
+            if ( tile.size() != 4 ) {
+                std::cerr << "failed to obtain tile=\""<< am.value( "tile" ) <<"\"\n";
+                return ReadResult::ERROR_IN_READING_FILE;
+            }
         }
 
         const std::string geocolumn = am.optionalValue( "geocolumn" ).empty() ? "geom" : am.value( "geocolumn" );
 
-        const int geomIdx   = PQfnumber( res.get(),  geocolumn.c_str() );
+        // per vertex feature ids for picking, see osgGIS/Shaders.h
+        const std::string idcolumn = am.optionalValue( "id_column" );
 
-        const int posIdx    = PQfnumber( res.get(),  "pos" );
+        // per vertex class index, colored by the palette given to setSymbology
+        const std::string classcolumn = am.optionalValue( "class_column" );
 
-        const int heightIdx = PQfnumber( res.get(),  "height" );
+        // comma separated columns kept by feature id, see osgGIS/AttributeTable.h
+        std::vector< std::string > attributeNames;
+        {
+            std::stringstream names( am.optionalValue( "attributes" ) );
+            std::string name;
 
-        const int widthIdx  = PQfnumber( res.get(),  "width" );
+            while ( std::getline( names, name, ',' ) ) {
+                name.erase( remove_if( name.begin(), name.end(), isspace ), name.end() );
 
-        osgGIS::Mesh mesh( layerToWord );
+                if ( !name.empty() ) {
+                    attributeNames.push_back( name );
+                }
+            }
+        }
 
-        if ( geomIdx >= 0 ) { // we have a geom column, we create the model from it
-            for( int i=0; i<numFeatures; i++ ) {
-                osgGIS::WKB wkb( PQgetvalue( res.get(), i, geomIdx ) );
-                assert( wkb.get() );
+        if ( !attributeNames.empty() && idcolumn.empty() ) {
+            std::cerr << "failed to obtain attributes=\"" << am.value( "attributes" ) << "\", an id_column is needed\n";
+            return ReadResult::ERROR_IN_READING_FILE;
+        }
+
+        osg::ref_ptr< osgGIS::AttributeTable > attributes = attributeNames.empty() ? 0 : new osgGIS::AttributeTable;
+        std::vector< int > attributeIdx;
+
+        DEBUG_OUT << "execute request and convert features...\n";
+        timer.setStartTick();
+
+        // results are binary: geometries are raw WKB (unless cast to text) and numbers are not parsed
+        osgGIS::PostgisConnection::RowStream rows( *conn, am.value( "query" ), tile, fetchSize );
+
+        if ( prefetch > 0 ) {
+            rows.prefetch( prefetch );
+        }
+
+        osgGIS::Mesh mesh( layerToWord, withNormals, arcTolerance );
+
+        int numFeatures = 0;
+
+        std::unique_ptr< FeatureConverter > convert;
+
+        std::unique_ptr< ParallelConverter > parallel;
+
+        while ( rows.next() ) {
+            if ( !convert.get() ) {
+                convert.reset( new FeatureConverter( rows.get(), geocolumn, idcolumn, classcolumn, instanced != 0, models ) );
+
+                if ( !convert->valid() ) {
+                    std::cerr << "cannot find either 'geom' column or 'height','width' columns\n";
+                    return ReadResult::ERROR_IN_READING_FILE;
+                }
+
+                if ( !idcolumn.empty() && !convert->hasIdColumn() ) {
+                    std::cerr << "cannot find id_column=\"" << idcolumn << "\"\n";
+                    return ReadResult::ERROR_IN_READING_FILE;
+                }
 
-                if ( !*wkb.get() ) {
-                    continue;    // null value from postgres
+                if ( !classcolumn.empty() && !convert->hasClassColumn() ) {
+                    std::cerr << "cannot find class_column=\"" << classcolumn << "\"\n";
+                    return ReadResult::ERROR_IN_READING_FILE;
                 }
 
-                mesh.push_back( wkb );
+                for ( std::vector< std::string >::const_iterator n = attributeNames.begin(); n != attributeNames.end(); n++ ) {
+                    attributeIdx.push_back( PQfnumber( rows.get(), n->c_str() ) );
+
+                    if ( attributeIdx.back() < 0 ) {
+                        std::cerr << "cannot find column \"" << *n << "\" of attributes\n";
+                        return ReadResult::ERROR_IN_READING_FILE;
+                    }
+
+                    if ( !osgGIS::isText( rows.get(), attributeIdx.back() ) && !osgGIS::isNumber( rows.get(), attributeIdx.back() ) ) {
+                        std::cerr << "unsupported type (oid " << PQftype( rows.get(), attributeIdx.back() ) << ") for column \""
+                                  << *n << "\" of attributes, cast it to text or float8\n";
+                        return ReadResult::ERROR_IN_READING_FILE;
+                    }
+
+                    attributes->addColumn( *n, osgGIS::isText( rows.get(), attributeIdx.back() )
+                                           ? osgGIS::AttributeTable::STRING : osgGIS::AttributeTable::NUMBER );
+                }
+
+                if ( numThreads > 1 ) {
+                    parallel.reset( new ParallelConverter( *convert, layerToWord, withNormals, arcTolerance, numThreads ) );
+                }
             }
-        }
-        else if ( posIdx >= 0 && heightIdx >= 0 && widthIdx >=0 ) { // we draw bars instead of geom
-            for( int i=0; i<numFeatures; i++ ) {
-                const float h = atof( PQgetvalue( res.get(), i, heightIdx ) );
-                const float w = atof( PQgetvalue( res.get(), i, widthIdx ) );
-                osgGIS::WKB wkb( PQgetvalue( res.get(), i, posIdx ) );
-                assert( wkb.get() );
 
-                if ( !*wkb.get() ) {
-                    continue;    // null value from postgres
+            numFeatures += PQntuples( rows.get() );
+
+            if ( attributes.valid() ) {
+                try {
+                    readAttributes( rows.get(), PQfnumber( rows.get(), idcolumn.c_str() ), attributeIdx, *attributes );
+                }
+                catch ( std::exception& e ) {
+                    std::cerr << "failed to read attributes: " << e.what() << "\n";
+                    return ReadResult::ERROR_IN_READING_FILE;
                 }
+            }
 
-                mesh.addBar( wkb, w, w, h );
+            try {
+                if ( parallel.get() ) {
+                    parallel->push_back( rows.release() );
+                }
+                else {
+                    ( *convert )( rows.get(), mesh );
+                }
+            }
+            catch ( std::exception& e ) {
+                std::cerr << "failed to convert features: " << e.what() << "\n";
+                return ReadResult::ERROR_IN_READING_FILE;
             }
         }
-        else {
-            std::cerr << "cannot find either 'geom' column or 'height','width' columns\n";
+
+        if ( parallel.get() ) {
+            try {
+                parallel->finish( mesh );
+            }
+            catch ( std::exception& e ) {
+                std::cerr << "failed to convert features: " << e.what() << "\n";
+                return ReadResult::ERROR_IN_READING_FILE;
+            }
+        }
+
+        if ( !rows ) {
+            std::cerr << "failed to execute query=\"" <<  am.value( "query" ) << "\" : " << rows.error() << "\n";
             return ReadResult::ERROR_IN_READING_FILE;
         }
 
-        osg::ref_ptr< osg::Geometry > geom = mesh.createGeometry();
+        if ( attributes.valid() ) {
+            attributes->index();
+        }
+
+        if ( mesh.numDroppedPolygons() ) {
+            std::cerr << "warning: " << mesh.numDroppedPolygons() << " polygons of the tile could not be triangulated\n";
+        }
+
+        const float vertexReduction = mesh.vertexReduction();
+        osg::ref_ptr< osg::Vec3Array > barPositions = new osg::Vec3Array;
+        osg::ref_ptr< osg::Vec2Array > barSizes = new osg::Vec2Array;
+        osg::ref_ptr< osg::UIntArray > barIds = new osg::UIntArray;
+        mesh.releaseBarInstances( *barPositions, *barSizes, *barIds );
+        osg::ref_ptr< osg::Vec3Array > modelPositions = new osg::Vec3Array;
+        osg::ref_ptr< osg::Vec2Array > modelScaleRotations = new osg::Vec2Array;
+        osg::ref_ptr< osg::UIntArray > modelIds = new osg::UIntArray;
+        mesh.releaseModelInstances( *modelPositions, *modelScaleRotations, *modelIds );
+        std::vector< std::pair< unsigned, unsigned > > extrusions;
+        mesh.releaseExtrusions( extrusions );
+        const bool hasLines = mesh.numLineSegments() > 0;
+        const bool hasSurfaces = mesh.numIndices() > 0;
+        osg::ref_ptr< osg::Geometry > lines = mesh.releaseLines();
+        osg::ref_ptr< osg::Geometry > geom = mesh.releaseGeometry();
 
         if ( !am.optionalValue( "elevation" ).empty() ) {
-            Dataset raster( am.value( "elevation" ).c_str() );
-            double transform[6];
-            raster->GetGeoTransform( transform );
-            const int pixelWidth = raster->GetRasterXSize();
-            const int pixelHeight = raster->GetRasterYSize();
+            osgGIS::GdalErrorScope gdalErrors;
 
-            // assume square pixels
-            assert( std::abs( transform[4] ) < FLT_EPSILON );
-            assert( std::abs( transform[2] ) < FLT_EPSILON );
+            // the raster stays opened from one tile to the next
+            osgGIS::DatasetPool::Handle raster( osgGIS::DatasetPool::instance(), am.value( "elevation" ) );
 
-            const double originX = transform[0];
-            const double originY = transform[3];
+            if ( !raster ) {
+                std::cerr << "cannot open dataset from elevation=\"" << am.value( "elevation" ) << "\"\n";
+                return ReadResult::ERROR_IN_READING_FILE;
+            }
 
-            const double pixelPerMetreX =  1.f/transform[1];
-            const double pixelPerMetreY = -1.f/transform[5]; // image is top->bottom
-            GDALRasterBand* band = raster->GetRasterBand( 1 );
-            GDALDataType dType = band->GetRasterDataType();
-            const int dSizeBits = GDALGetDataTypeSize( dType );
-            std::vector<char> buffer( dSizeBits / 8  );
-            char* blockData = &buffer[0];
+            osg::Vec3Array* vtx = dynamic_cast<osg::Vec3Array*>( geom->getVertexArray() );
+
+            assert( vtx );
+
+            osg::Vec3Array* lineVtx = dynamic_cast<osg::Vec3Array*>( lines->getVertexArray() );
 
-            double dataOffset;
-            int ok;
-            dataOffset = band->GetOffset( &ok );
+            assert( lineVtx );
 
-            if ( ! ok ) {
-                dataOffset = 0.0;
+            // mesh and line vertices, bar and model instances
+            osg::Vec3Array* const draped[] = { vtx, lineVtx, barPositions.get(), modelPositions.get() };
+            const size_t numDraped = sizeof( draped )/sizeof( osg::Vec3Array* );
+
+            // the raster is read once, over the bounding box of the tile
+            osg::BoundingBox bbox;
+
+            for ( size_t d = 0; d < numDraped; d++ ) {
+                for ( osg::Vec3Array::iterator v = draped[d]->begin(); v!=draped[d]->end(); v++ ) {
+                    bbox.expandBy( *v );
+                }
             }
 
-            const double dataScale = band->GetScale( &ok );
+            if ( bbox.valid() ) {
+                const osgGIS::ElevationSampler sampler( &*raster,
+                                                        bbox.xMin() + origin.x(), bbox.yMin() + origin.y(),
+                                                        bbox.xMax() + origin.x(), bbox.yMax() + origin.y() );
 
-            assert( ok );
+                // extruded features keep their height above the ground
+                const bool extruded = convert.get() && convert->extruded();
 
-            osg::Vec3Array* vtx = dynamic_cast<osg::Vec3Array*>( geom->getVertexArray() );
+                // a building or a bar stands as a whole on the lowest ground under it,
+                // its roof stays flat on slopes
+                std::vector< bool > raised( vtx->size(), false );
 
-            assert( vtx );
+                for ( size_t e = 0; e < extrusions.size(); e++ ) {
+                    double ground = std::numeric_limits< double >::max();
+
+                    for ( unsigned i = extrusions[e].first; i < extrusions[e].second; i++ ) {
+                        double z;
+
+                        if ( sampler.sample( ( *vtx )[i].x() + origin.x(), ( *vtx )[i].y() + origin.y(), z ) ) {
+                            ground = std::min( ground, z );
+                        }
+                    }
 
-            for ( osg::Vec3Array::iterator v = vtx->begin(); v!=vtx->end(); v++ ) {
-                const int posX = int( ( v->x() + origin.x() - originX )*pixelPerMetreX );
-                const int posY = int( ( originY - v->y() - origin.y() )*pixelPerMetreY );
+                    if ( ground == std::numeric_limits< double >::max() ) {
+                        continue; // outside the raster, left as draped vertices are
+                    }
 
-                if ( posX >=0 && posX < pixelWidth && posY >= 0 && posY < pixelHeight ) {
-                    band->RasterIO( GF_Read, posX, posY, 1, 1, blockData, 1, 1, dType, 0, 0 );
-                    v->z() = float( ( SRCVAL( blockData, dType, 0 ) * dataScale )  + dataOffset ) - origin.z();
+                    for ( unsigned i = extrusions[e].first; i < extrusions[e].second; i++ ) {
+                        ( *vtx )[i].z() += float( ground );
+                        raised[i] = true;
+                    }
                 }
+
+                for ( size_t d = 0; d < numDraped; d++ ) {
+                    for ( osg::Vec3Array::iterator v = draped[d]->begin(); v!=draped[d]->end(); v++ ) {
+                        if ( d == 0 && raised[ v - vtx->begin() ] ) {
+                            continue;
+                        }
+
+                        double z;
+
+                        if ( sampler.sample( v->x() + origin.x(), v->y() + origin.y(), z ) ) {
+                            v->z() = extruded ? v->z() + float( z ) : float( z - origin.z() );
+                        }
+                    }
+                }
+            }
+
+            if ( !gdalErrors.error().empty() ) {
+                std::cerr << "from GDAL: " << gdalErrors.error() << "\n";
+                return ReadResult::ERROR_IN_READING_FILE;
+            }
+        }
+
+        OSG_INFO << "postgis: converted " << numFeatures << " features in " << timer.time_s() << "sec, "
+                 << vertexReduction << " triangle corners per vertex\n";
+
+        if ( models ) {
+            if ( modelPositions->empty() ) {
+                return withAttributes( new osg::Group, attributes.get() );
+            }
+
+            try {
+                return withAttributes( osgGIS::instancedModels( model, modelPositions.get(), modelScaleRotations.get(), modelIds.get() ), attributes.get() );
+            }
+            catch ( std::exception& e ) {
+                std::cerr << "failed to place model=\"" << model << "\": " << e.what() << "\n";
+                return ReadResult::ERROR_IN_READING_FILE;
             }
         }
 
-        DEBUG_OUT << "converted " << numFeatures << " features in " << timer.time_s() << "sec\n";
+        // bar layers have no mesh when instanced
+        if ( !barPositions->empty() ) {
+            osg::ref_ptr<osg::Geode> group = new osg::Geode();
+            group->addDrawable( osgGIS::instancedBars( barPositions.get(), barSizes.get(), barIds.get() ) );
+            return withAttributes( group.release(), attributes.get() );
+        }
+
+        // all lines of the tile are drawn at once, next to the surfaces if any
+        osg::ref_ptr<osg::Geode> lineGeode;
+
+        if ( hasLines ) {
+            if ( lineWidth > 0 ) {
+                lineGeode = osgGIS::ribbons( *lines, lineWidth );
+            }
+            else {
+                lineGeode = new osg::Geode();
+                lineGeode->addDrawable( lines.get() );
+            }
+
+            if ( !hasSurfaces ) {
+                return withAttributes( lineGeode.release(), attributes.get() );
+            }
+        }
+
+        osg::ref_ptr<osg::Node> surfaces;
+
+        if ( quantize ) {
+            surfaces = osgGIS::quantize( *geom );
+        }
+        else {
+            osg::ref_ptr<osg::Geode> geode = new osg::Geode();
+            geode->addDrawable( geom.get() );
+            surfaces = geode.get();
+
+            // the tree for picking is built here, in the pager thread, rather than on
+            // the first intersection; kd-trees need float positions, osg does not
+            // intersect quantized tiles
+            if ( !idcolumn.empty() ) {
+                osg::ref_ptr<osg::KdTreeBuilder> kdTreeBuilder = new osg::KdTreeBuilder;
+                surfaces->accept( *kdTreeBuilder );
+            }
+        }
+
+        if ( !lineGeode.valid() ) {
+            return withAttributes( surfaces.release(), attributes.get() );
+        }
 
-        osg::ref_ptr<osg::Geode> group = new osg::Geode();
-        group->addDrawable( geom.get() );
-        return group.release();
+        osg::ref_ptr<osg::Group> group = new osg::Group();
+        group->addChild( surfaces.get() );
+        group->addChild( lineGeode.get() );
+        return withAttributes( group.release(), attributes.get() );
     }
 };
 
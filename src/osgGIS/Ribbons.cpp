@@ -0,0 +1,193 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Ribbons.h"
+#include "Shaders.h"
+
+#include <osg/NodeCallback>
+#include <osg/Viewport>
+#include <osgUtil/CullVisitor>
+
+#include <stdexcept>
+
+namespace osgGIS {
+
+namespace {
+// generic attributes, after those of instanced models
+const unsigned OTHER_END_ATTRIBUTE = 11;
+const unsigned SIDE_ATTRIBUTE = 12;
+
+// the other end is projected too, its offset is perpendicular to the screen direction
+// of the segment, side is +/-1 and flips with the direction at the far end
+const char* ribbonVertexSource = {
+    "#version 120\n"
+    "attribute vec3 otherEnd;\n"
+    "attribute float side;\n"
+    "attribute float featureId;\n"
+    "uniform vec2 viewport;\n"
+    "uniform float lineWidth;\n"
+    "\n"
+    "bool featureVisible( float id );\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    vec4 p = gl_ModelViewProjectionMatrix * gl_Vertex;\n"
+    "    vec4 o = gl_ModelViewProjectionMatrix * vec4( otherEnd, 1.0 );\n"
+    "    vec2 d = ( o.xy / o.w - p.xy / p.w ) * viewport;\n"
+    "    vec2 n = dot( d, d ) > 0.0 ? normalize( vec2( -d.y, d.x ) ) : vec2( 0.0 );\n"
+    "    p.xy += side * lineWidth * n / viewport * p.w;\n"
+    "    gl_Position = featureVisible( featureId ) ? p : vec4( 2.0, 2.0, 2.0, 1.0 );\n"
+    "}\n"
+};
+
+const char* ribbonFragmentSource = {
+    "#version 120\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    gl_FragColor = gl_FrontMaterial.diffuse;\n"
+    "}\n"
+};
+
+//! pixels are converted to clip coordinates with the viewport of the camera culling the tile
+struct ViewportUniform : osg::NodeCallback {
+    ViewportUniform( osg::Uniform* viewport )
+        : _viewport( viewport )
+    {}
+
+    void operator()( osg::Node* node, osg::NodeVisitor* nv ) {
+        osgUtil::CullVisitor* cv = dynamic_cast< osgUtil::CullVisitor* >( nv );
+
+        if ( cv && cv->getViewport() ) {
+            _viewport->set( osg::Vec2( cv->getViewport()->width(), cv->getViewport()->height() ) );
+        }
+
+        traverse( node, nv );
+    }
+
+private:
+    const osg::ref_ptr<osg::Uniform> _viewport;
+};
+
+osg::Program* createRibbonsProgram()
+{
+    osg::ref_ptr<osg::Program> program = new osg::Program;
+    program->addShader( new osg::Shader( osg::Shader::VERTEX, ribbonVertexSource ) );
+    program->addShader( new osg::Shader( osg::Shader::FRAGMENT, ribbonFragmentSource ) );
+    program->addShader( new osg::Shader( osg::Shader::VERTEX, FEATURE_FILTER_VERTEX_SOURCE ) );
+    program->addBindAttribLocation( "otherEnd", OTHER_END_ATTRIBUTE );
+    program->addBindAttribLocation( "side", SIDE_ATTRIBUTE );
+    program->addBindAttribLocation( "featureId", FEATURE_ID_ATTRIBUTE );
+    return program.release();
+}
+}
+
+osg::Program* ribbonsProgram()
+{
+    static const osg::ref_ptr<osg::Program> program( createRibbonsProgram() );
+    return program.get();
+}
+
+osg::Geode* ribbons( const osg::Geometry& lines, float width )
+{
+    const osg::Vec3Array* vtx = dynamic_cast< const osg::Vec3Array* >( lines.getVertexArray() );
+    const osg::DrawElementsUInt* seg = lines.getNumPrimitiveSets() == 1
+                                       ? dynamic_cast< const osg::DrawElementsUInt* >( lines.getPrimitiveSet( 0 ) )
+                                       : 0;
+
+    if ( !vtx || !seg || seg->getMode() != GL_LINES ) {
+        throw std::runtime_error( "cannot create ribbons, indexed lines expected" );
+    }
+
+    const size_t numSegments = seg->size() / 2;
+    const osg::UIntArray* lineIds = dynamic_cast< const osg::UIntArray* >( lines.getVertexAttribArray( FEATURE_ID_ATTRIBUTE ) );
+
+    osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array;
+    osg::ref_ptr<osg::Vec3Array> otherEnds = new osg::Vec3Array;
+    osg::ref_ptr<osg::FloatArray> sides = new osg::FloatArray;
+    osg::ref_ptr<osg::UIntArray> ids = new osg::UIntArray;
+    osg::ref_ptr<osg::DrawElementsUInt> elem = new osg::DrawElementsUInt( GL_TRIANGLES );
+    vertices->reserve( 4 * numSegments );
+    otherEnds->reserve( 4 * numSegments );
+    sides->reserve( 4 * numSegments );
+    elem->reserve( 6 * numSegments );
+
+    // left and right of each end, both triangles are counterclockwise on screen
+    for ( size_t s = 0; s < numSegments; s++ ) {
+        const osg::Vec3& a = ( *vtx )[ ( *seg )[2*s] ];
+        const osg::Vec3& b = ( *vtx )[ ( *seg )[2*s+1] ];
+        const unsigned first = vertices->size();
+
+        vertices->push_back( a );
+        otherEnds->push_back( b );
+        sides->push_back( 1 );
+        vertices->push_back( a );
+        otherEnds->push_back( b );
+        sides->push_back( -1 );
+        vertices->push_back( b );
+        otherEnds->push_back( a );
+        sides->push_back( -1 );
+        vertices->push_back( b );
+        otherEnds->push_back( a );
+        sides->push_back( 1 );
+
+        if ( lineIds ) {
+            ids->insert( ids->end(), 2, ( *lineIds )[ ( *seg )[2*s] ] );
+            ids->insert( ids->end(), 2, ( *lineIds )[ ( *seg )[2*s+1] ] );
+        }
+
+        elem->push_back( first );
+        elem->push_back( first + 1 );
+        elem->push_back( first + 2 );
+        elem->push_back( first + 1 );
+        elem->push_back( first + 3 );
+        elem->push_back( first + 2 );
+    }
+
+    osg::ref_ptr<osg::Geometry> geom = new osg::Geometry;
+    geom->setUseVertexBufferObjects( true );
+    geom->setVertexArray( vertices.get() );
+    geom->setVertexAttribArray( OTHER_END_ATTRIBUTE, otherEnds.get() );
+    geom->setVertexAttribBinding( OTHER_END_ATTRIBUTE, osg::Geometry::BIND_PER_VERTEX );
+    geom->setVertexAttribArray( SIDE_ATTRIBUTE, sides.get() );
+    geom->setVertexAttribBinding( SIDE_ATTRIBUTE, osg::Geometry::BIND_PER_VERTEX );
+
+    if ( lineIds ) {
+        geom->setVertexAttribArray( FEATURE_ID_ATTRIBUTE, ids.get() );
+        geom->setVertexAttribBinding( FEATURE_ID_ATTRIBUTE, osg::Geometry::BIND_PER_VERTEX );
+    }
+
+    geom->addPrimitiveSet( elem.get() );
+
+    osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+    geode->addDrawable( geom.get() );
+
+    // each tile has its own viewport uniform, set during its cull
+    osg::ref_ptr<osg::Uniform> viewport = new osg::Uniform( "viewport", osg::Vec2( 1, 1 ) );
+    viewport->setDataVariance( osg::Object::DYNAMIC );
+    geode->setCullCallback( new ViewportUniform( viewport.get() ) );
+
+    osg::StateSet* stateset = geode->getOrCreateStateSet();
+    stateset->setAttributeAndModes( ribbonsProgram() );
+    stateset->addUniform( viewport.get() );
+    stateset->addUniform( new osg::Uniform( "lineWidth", width ) );
+    stateset->addUniform( new osg::Uniform( "visibility", int( VISIBILITY_TEXTURE_UNIT ) ) );
+    return geode.release();
+}
+
+}
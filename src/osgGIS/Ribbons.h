@@ -0,0 +1,45 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STACK3D_OSGGIS_RIBBONS
+#define STACK3D_OSGGIS_RIBBONS
+
+#include <osg/Geometry>
+#include <osg/Geode>
+#include <osg/Program>
+
+namespace osgGIS {
+
+//! @brief lines of constant screen width, all lines of a tile in one drawable
+//!
+//! Each segment becomes a quad whose four vertices hold both segment ends, the
+//! vertex shader of ribbonsProgram() moves them aside by half the width in pixels,
+//! perpendicularly to the projected segment. Joints are not filled, which does not
+//! show for the few pixels wide lines of networks.
+//!
+//! @param lines GL_LINES geometry from Mesh::releaseLines(), also the fallback drawable
+//!        when shaders are not wanted, its feature ids are kept
+//! @param width in pixels
+osg::Geode* ribbons( const osg::Geometry& lines, float width );
+
+//! @brief expands and colors the ribbons with the front material diffuse color, the
+//!        ribbons of filtered features are hidden (see FEATURE_FILTER_VERTEX_SOURCE)
+osg::Program* ribbonsProgram();
+
+}
+#endif
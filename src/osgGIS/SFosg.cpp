@@ -17,12 +17,18 @@
  *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 #include "SFosg.h"
+#include "WkbReader.h"
+#include "Shaders.h"
 
+#ifdef HAVE_GLU
 #include <GL/glu.h>
+#endif
 
+#ifdef HAVE_LWGEOM
 extern "C" {
 #include <liblwgeom.h>
 }
+#endif
 
 #include <boost/format.hpp>
 #include <boost/graph/adjacency_list.hpp>
@@ -30,39 +36,47 @@ extern "C" {
 #include <boost/graph/undirected_dfs.hpp>
 #include <boost/noncopyable.hpp>
 
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+
 #include <iostream>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
 
 // poly2tri gives better triangulation (delauny) than GLUtesselator
 // in about twice the time (wich is really good)
 // but since it's not robust, even with valid geometries (touching rings),
-// we keep it for latter use
+// we keep it for latter use, built with POLY2TRI defined by SFosg_poly2tri_test only
 //#define POLY2TRI
 #ifdef POLY2TRI
 #include "../poly2tri/poly2tri.h"
 #include <memory>
 #include <iomanip>
+#include <map>
+#include <algorithm>
+#include <cfloat>
 #endif
 
 namespace osgGIS {
 
+namespace {
+const unsigned NO_VERTEX = unsigned( -1 );
+}
+
+#ifdef HAVE_LWGEOM
+//! last liblwgeom error of the calling thread
+//! @note liblwgeom handlers are process wide, so the handler does not throw
+//!       through liblwgeom but records the error for the thread that caused it
+thread_local std::string lwgeomError;
+
 //! custom error reporter for liblwgeom
 inline
 void errorreporter( const char* fmt, va_list ap )
 {
-    struct RaiiCharPtr {
-        ~RaiiCharPtr() {
-            free( ptr );
-        }
-        char* ptr;
-    } msg;
-
-    if ( !vasprintf ( &msg.ptr, fmt, ap ) ) {
-        va_end ( ap );
-        throw std::runtime_error( "unexpected error" );
-    }
-
-    va_end ( ap );
-    throw std::runtime_error( std::string( "from liblwgeom: " )+msg.ptr );
+    char msg[1024];
+    vsnprintf( msg, sizeof( msg ), fmt, ap );
+    lwgeomError = msg;
 }
 
 // dummy class INSTANCE (this is a definition, look at the end!)
@@ -75,12 +89,10 @@ const struct LwgeomInitialiser {
 
 
 // utility class for RAII of LWGEOM
+// @note only used for WKT, WKB is decoded by WkbReader
 struct Lwgeom {
     Lwgeom( WKT wkt )
-        : _geom( lwgeom_from_wkt( wkt.get(), LW_PARSER_CHECK_NONE ) )
-    {}
-    Lwgeom( WKB wkb )
-        : _geom( lwgeom_from_hexwkb( wkb.get(), LW_PARSER_CHECK_NONE ) )
+        : _geom( parse( wkt ) )
     {}
     operator bool() const {
         return _geom;
@@ -98,7 +110,31 @@ struct Lwgeom {
     }
 private:
     LWGEOM* _geom;
+
+    static LWGEOM* parse( WKT wkt ) {
+        // the bison parser of liblwgeom keeps its state in globals
+        static OpenThreads::Mutex parserMutex;
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( parserMutex );
+
+        lwgeomError.clear();
+        LWGEOM* geom = lwgeom_from_wkt( wkt.get(), LW_PARSER_CHECK_NONE );
+
+        if ( !lwgeomError.empty() ) {
+            if ( geom ) {
+                lwgeom_free( geom );
+            }
+
+            throw std::runtime_error( "from liblwgeom: " + lwgeomError );
+        }
+
+        if ( !geom ) {
+            throw std::runtime_error( "from liblwgeom: cannot parse WKT" );
+        }
+
+        return geom;
+    }
 };
+#endif
 
 // for debugging
 inline
@@ -108,6 +144,53 @@ std::ostream& operator<<( std::ostream& o, const osg::Vec3& v )
     return o;
 }
 
+//! Newell's formula, the ring may or may not be closed
+inline
+const osg::Vec3 newellNormal( const osg::Vec3d* ring, size_t npoints )
+{
+    osg::Vec3d normal( 0.0, 0.0, 0.0 );
+
+    for ( size_t i = 0; i < npoints; ++i ) {
+        const osg::Vec3d& pi = ring[i];
+        const osg::Vec3d& pj = ring[ ( i+1 ) % npoints ];
+        normal[0] += ( pi[1] - pj[1] ) * ( pi[2] + pj[2] );
+        normal[1] += ( pi[2] - pj[2] ) * ( pi[0] + pj[0] );
+        normal[2] += ( pi[0] - pj[0] ) * ( pi[1] + pj[1] );
+    }
+
+    normal.normalize();
+    return normal;
+}
+
+void Mesh::beginPolygon( bool hasZ )
+{
+    _ringVtx.clear();
+    _ringSize.clear();
+    _hasZ = hasZ;
+}
+
+void Mesh::beginRing( unsigned numPoints )
+{
+    _ringSize.push_back( numPoints );
+}
+
+void Mesh::vertex( const osg::Vec3d& layerPoint )
+{
+    // extruded footprints are moved to their base
+    _ringVtx.push_back( ( _extruding ? osg::Vec3d( layerPoint.x(), layerPoint.y(), _base ) : layerPoint ) * _layerToWord );
+}
+
+// all vertices of a polygon have the same normal, triangles share them
+unsigned Mesh::meshVertex( size_t ringVertex )
+{
+    if ( _ringToMesh[ ringVertex ] == NO_VERTEX ) {
+        _ringToMesh[ ringVertex ] = _vtx.size();
+        _vtx.push_back( _ringVtx[ ringVertex ] );
+    }
+
+    return _ringToMesh[ ringVertex ];
+}
+
 
 #ifdef POLY2TRI
 
@@ -164,17 +247,17 @@ struct Ring2d : std::vector< osg::Vec2 > {};
 //! and prunes dupplicate points and remove last point
 //! we keep the last point wich should be a duplicate of the first
 struct Poly : boost::noncopyable {
-    Poly( const LWPOLY* lwpoly, const osg::Matrix& layerToWord  )
-        : rings( lwpoly->nrings ) {
+    Poly( const std::vector< osg::Vec3d >& ringVtx, const std::vector< unsigned >& ringSize )
+        : rings( ringSize.size() ) {
         const size_t nrings = rings.size();
+        const osg::Vec3d* src = ringVtx.empty() ? NULL : &ringVtx[0];
 
         for ( size_t r=0; r<nrings; r++ ) {
-            const size_t npoints = lwpoly->rings[r]->npoints;
+            const size_t npoints = ringSize[r];
             rings[r].reserve( npoints );
 
-            for ( size_t p=0; p<npoints; p++ ) {
-                const POINT3DZ p3D = getPoint3dz( lwpoly->rings[r], p );
-                const osg::Vec3 point =  osg::Vec3( p3D.x, p3D.y, p3D.z ) * layerToWord;
+            for ( size_t p=0; p<npoints; p++, src++ ) {
+                const osg::Vec3 point( *src );
 
                 if ( !p || rings[r].back() != point ) {
                     rings[r].push_back( point );
@@ -251,32 +334,70 @@ bool isPlane( const Poly& poly, const osg::Vec3* nrml = NULL, float epsilon = FL
     return true;
 }
 
+//! @return true if the ray from point toward the positive y direction crosses the segment
 inline
-bool isCovered( const osg::Vec2& point, const Ring2d& ring )
+bool crosses( const osg::Vec2& point, const osg::Vec2& start, const osg::Vec2& end )
 {
-    // use ray casting algorithm
-    // ray travels from point toward the positive y direction (constant x),
-    // so crossing a boundary segment [start, end] means:
+    // crossing a boundary segment [start, end] means:
     // - start.x <= point.x < end.x || end.x < point.x <= start.x
     // - intersection of segment with the ray is above the point
+    //
+    // special case with vertical segments aligned above the point
+    // we don't consider crossing since it will cross the next segment its start
+    // ence the <= or >= at start
+    return start.x() != end.x()
+           && ( ( ( start.x() <= point.x() ) && ( point.x() < end.x() ) ) || ( ( end.x() < point.x() ) && ( point.x() <= start.x() ) ) )
+           && start.y() + ( ( point.x() - start.x() ) / ( end.x() - start.x() ) ) * ( end.y() - start.y() ) >= point.y();
+}
+
+inline
+bool isCovered( const osg::Vec2& point, const Ring2d& ring )
+{
+    // use ray casting algorithm
     std::size_t intersectionCount = 0;
     const size_t npoints = ring.size();
 
+    for ( size_t i = 0; i < npoints; ++i ) {
+        if ( crosses( point, ring[i], ring[ ( i+1 ) % npoints ] ) ) {
+            ++intersectionCount;
+        }
+    }
+
+    return intersectionCount%2; // even -> outside
+}
+
+//! isCovered for several points, each segment is only tested with the points in its x range
+//! @note n log n, plus the number of crossings
+inline
+const std::vector< bool > areCovered( const std::vector< osg::Vec2 >& points, const Ring2d& ring )
+{
+    std::vector< std::pair< float, size_t > > byX;
+    byX.reserve( points.size() );
+
+    for ( size_t p = 0; p < points.size(); ++p ) {
+        byX.push_back( std::make_pair( points[p].x(), p ) );
+    }
+
+    std::sort( byX.begin(), byX.end() );
+
+    std::vector< bool > covered( points.size(), false );
+    const size_t npoints = ring.size();
+
     for ( size_t i = 0; i < npoints; ++i ) {
         const osg::Vec2 start = ring[i];
         const osg::Vec2 end = ring[ ( i+1 ) % npoints ];
+        const float xmax = std::max( start.x(), end.x() );
 
-        // special case with vertical segments aligned above the point
-        // we don't consider crossing since it will cross the next segment its start
-        // ence the <= or >= at start
-        if ( start.x() != end.x()
-                && ( ( ( start.x() <= point.x() ) && ( point.x() < end.x() ) ) || ( ( end.x() < point.x() ) && ( point.x() <= start.x() ) ) )
-                && start.y() + ( ( point.x() - start.x() ) / ( end.x() - start.x() ) ) * ( end.y() - start.y() ) >= point.y()  ) {
-            ++intersectionCount;
+        for ( std::vector< std::pair< float, size_t > >::const_iterator p =
+                    std::lower_bound( byX.begin(), byX.end(), std::make_pair( std::min( start.x(), end.x() ), size_t( 0 ) ) );
+                p != byX.end() && p->first <= xmax; ++p ) {
+            if ( crosses( points[p->second], start, end ) ) {
+                covered[p->second] = !covered[p->second];
+            }
         }
     }
 
-    return intersectionCount%2; // even -> outside
+    return covered;
 }
 
 struct Segment2d: boost::noncopyable {
@@ -379,33 +500,232 @@ private:
     std::vector< osg::Vec2 > _points;
 };
 
+//! bounding box of a segment (index of its start in the ring) or of a whole ring
+struct Box2d {
+    float xmin, ymin, xmax, ymax;
+    size_t ring;
+    size_t index;
+};
+
 inline
-bool selfIntersects( const Ring2d& ring )
+bool operator<( const Box2d& lhs, const Box2d& rhs )
 {
-    // stupid O( n² ) algo
-    const size_t npoints = ring.size() - 1;
-    const size_t npointsMinus = npoints - 1;
+    return lhs.xmin < rhs.xmin;
+}
+
+//! boxes of the segments of all rings, inflated by the tolerance of Intersection
+inline
+const std::vector< Box2d > segmentBoxes( const Poly2d& poly )
+{
+    std::vector< Box2d > boxes;
+    const size_t nrings = poly.rings.size();
+
+    for ( size_t r=0; r<nrings; r++ ) {
+        const size_t npoints = poly.rings[r].size() - 1;
+
+        for ( size_t i=0; i<npoints; i++ ) {
+            const osg::Vec2 start = poly.rings[r][i];
+            const osg::Vec2 end = poly.rings[r][i+1];
+            // Intersection tolerances are absolute: segments further apart than
+            // FLT_EPSILON / length may still be found aligned
+            const float length = std::max( ( end - start ).length(), FLT_EPSILON );
+            const float magnitude = std::max( std::max( std::abs( start.x() ), std::abs( start.y() ) ),
+                                              std::max( std::abs( end.x() ), std::abs( end.y() ) ) );
+            const float margin = 2 * FLT_EPSILON * ( 1 + magnitude + length + 1 / length );
+            const Box2d box = { std::min( start.x(), end.x() ) - margin, std::min( start.y(), end.y() ) - margin,
+                                std::max( start.x(), end.x() ) + margin, std::max( start.y(), end.y() ) + margin,
+                                r, i
+                              };
+            boxes.push_back( box );
+        }
+    }
+
+    return boxes;
+}
+
+//! active boxes of the sweep along x, indexed on y by a segment tree whose leaves are the
+//! ymin of all boxes: a box is listed in the nodes covering its y range, to be found by
+//! the boxes starting within it, and in the ancestors of its ymin leaf, to be found by
+//! the boxes it starts within
+//!
+//! boxes left behind by the sweep are removed from the lists as they are visited, each
+//! visit costs log n plus the boxes found or removed
+class ActiveBoxes {
+public:
+    ActiveBoxes( const std::vector< Box2d >& boxes )
+        : _numLeaves( 1 ) {
+        for ( std::vector< Box2d >::const_iterator b = boxes.begin(); b != boxes.end(); b++ ) {
+            _y.push_back( b->ymin );
+        }
+
+        std::sort( _y.begin(), _y.end() );
+        _y.erase( std::unique( _y.begin(), _y.end() ), _y.end() );
+
+        while ( _numLeaves < _y.size() ) {
+            _numLeaves *= 2;
+        }
+
+        _covering.resize( 2 * _numLeaves );
+        _starting.resize( 2 * _numLeaves );
+    }
+
+    void insert( const Box2d& box ) {
+        const size_t first = leaf( box.ymin );
+
+        for ( size_t l = first + _numLeaves, h = lastLeaf( box.ymax ) + _numLeaves + 1; l < h; l /= 2, h /= 2 ) {
+            if ( l & 1 ) {
+                _covering[l++].push_back( &box );
+            }
+
+            if ( h & 1 ) {
+                _covering[--h].push_back( &box );
+            }
+        }
+
+        for ( size_t n = first + _numLeaves; n; n /= 2 ) {
+            _starting[n].push_back( &box );
+        }
+    }
 
-    for ( size_t i=0; i<npointsMinus; i++ ) {
-        const Segment2d s1( ring[i], ring[i+1] );
+    //! calls visitor( a, box ) for each active box a overlapping box along y, once
+    template< typename Visitor >
+    void visit( const Box2d& box, Visitor& visitor ) {
+        const size_t first = leaf( box.ymin );
+
+        // those starting below or at box.ymin and reaching it
+        for ( size_t n = first + _numLeaves; n; n /= 2 ) {
+            visit( _covering[n], box, visitor );
+        }
 
-        for ( size_t j=i+2; j<npoints; j++ ) { // do not test neighbors
-            const Segment2d s2( ring[j], ring[j+1] );
-            const Intersection inter( s1, s2 );
+        // those starting above box.ymin, up to box.ymax
+        for ( size_t l = first + 1 + _numLeaves, h = lastLeaf( box.ymax ) + _numLeaves + 1; l < h; l /= 2, h /= 2 ) {
+            if ( l & 1 ) {
+                visit( _starting[l++], box, visitor );
+            }
 
-            if ( inter.dimension() > 0  && !( inter.dimension() == 1 && 0 == i && ( npoints - 1 ) == j ) ) {
-                return true;
+            if ( h & 1 ) {
+                visit( _starting[--h], box, visitor );
             }
         }
     }
 
-    return false;
+private:
+    typedef std::vector< const Box2d* > BoxList;
+    std::vector< float > _y;
+    size_t _numLeaves;
+    std::vector< BoxList > _covering;
+    std::vector< BoxList > _starting;
+
+    size_t leaf( float ymin ) const {
+        return std::lower_bound( _y.begin(), _y.end(), ymin ) - _y.begin();
+    }
+
+    //! last leaf not above ymax
+    size_t lastLeaf( float ymax ) const {
+        return std::upper_bound( _y.begin(), _y.end(), ymax ) - _y.begin() - 1;
+    }
+
+    template< typename Visitor >
+    void visit( BoxList& list, const Box2d& box, Visitor& visitor ) {
+        size_t numActive = 0;
+
+        for ( size_t a=0; a<list.size(); a++ ) {
+            if ( list[a]->xmax >= box.xmin ) {
+                list[numActive++] = list[a];
+                visitor( *list[a], box );
+            }
+        }
+
+        list.resize( numActive );
+    }
+};
+
+//! sweeps along x and calls visitor( a, b ) for each pair of overlapping boxes
+//! @note n log n, plus the number of overlapping pairs
+template< typename Visitor >
+void overlappingBoxes( std::vector< Box2d >& boxes, Visitor& visitor )
+{
+    std::sort( boxes.begin(), boxes.end() );
+    ActiveBoxes active( boxes );
+
+    for ( std::vector< Box2d >::const_iterator b = boxes.begin(); b != boxes.end(); b++ ) {
+        active.visit( *b, visitor );
+        active.insert( *b );
+    }
 }
 
+//! point or line contact between segment i of ring ri and segment j of ring rj, ri < rj
+struct RingContact {
+    size_t ri, rj, i, j;
+    size_t dimension;
+    osg::Vec2 point;
+};
+
+inline
+bool operator<( const RingContact& lhs, const RingContact& rhs )
+{
+    return lhs.ri != rhs.ri ? lhs.ri < rhs.ri
+           : lhs.rj != rhs.rj ? lhs.rj < rhs.rj
+           : lhs.i != rhs.i ? lhs.i < rhs.i
+           : lhs.j < rhs.j;
+}
+
+//! tests segments pairs found by the sweep, in the order of the former exhaustive loops
+//! (lower segment index first) to give the same results
+struct SegmentIntersections {
+    SegmentIntersections( const Poly2d& poly )
+        : selfIntersects( poly.rings.size(), false )
+        , _poly( poly )
+    {}
+
+    void operator()( const Box2d& a, const Box2d& b ) {
+        const bool ordered = a.ring < b.ring || ( a.ring == b.ring && a.index < b.index );
+        const Box2d& first = ordered ? a : b;
+        const Box2d& second = ordered ? b : a;
+        const Ring2d& ring1 = _poly.rings[first.ring];
+        const Ring2d& ring2 = _poly.rings[second.ring];
+        const size_t i = first.index;
+        const size_t j = second.index;
+
+        if ( first.ring == second.ring && j == i + 1 ) {
+            return; // do not test neighbors
+        }
+
+        const Segment2d s1( ring1[i], ring1[i+1] );
+        const Segment2d s2( ring2[j], ring2[j+1] );
+        const Intersection inter( s1, s2 );
+
+        if ( !inter.dimension() ) {
+            return;
+        }
+
+        if ( first.ring == second.ring ) {
+            const size_t npoints = ring1.size() - 1;
+
+            if ( !( inter.dimension() == 1 && 0 == i && ( npoints - 1 ) == j ) ) {
+                selfIntersects[first.ring] = true;
+            }
+        }
+        else {
+            const RingContact contact = { first.ring, second.ring, i, j, inter.dimension(),
+                                          inter.dimension() == 1 ? inter.point() : osg::Vec2()
+                                        };
+            contacts.push_back( contact );
+        }
+    }
+
+    std::vector< bool > selfIntersects;
+    std::vector< RingContact > contacts;
+private:
+    const Poly2d& _poly;
+};
+
 const size_t INF = size_t( -1 );
-//! @return the number of point itersections, INF if line intersection
+//! @return the number of point itersections between rings contact->ri and contact->rj,
+//!         INF if line intersection
+//! @param contact first of the sorted contacts between the two rings, advanced past the last one
 inline
-size_t nbIntersections( const Ring2d& ring1, const Ring2d& ring2 )
+size_t nbIntersections( std::vector< RingContact >::const_iterator& contact, std::vector< RingContact >::const_iterator end )
 {
 
     // insert only points that are far enought from already inserted ones
@@ -428,31 +748,37 @@ size_t nbIntersections( const Ring2d& ring1, const Ring2d& ring2 )
     };
 
     UniquePointSet set;
+    size_t nbInter = 0;
+    const size_t ri = contact->ri;
+    const size_t rj = contact->rj;
 
-    // stupid O( n x m ) algo
-    const size_t npoints1 = ring1.size() - 1;
-    const size_t npoints2 = ring2.size() - 1;
-
-    for ( size_t i=0; i<npoints1; i++ ) {
-        const Segment2d s1( ring1[i], ring1[i+1] );
-
-        for ( size_t j=0; j<npoints2; j++ ) {
-            const Segment2d s2( ring2[j], ring2[j+1] );
-            const Intersection inter( s1, s2 );
+    for ( ; contact != end && contact->ri == ri && contact->rj == rj; contact++ ) {
+        if ( nbInter == INF ) {
+            continue;
+        }
 
-            if ( inter.dimension() == 1 ) {
-                set.insert( inter.point() );
-            }
-            else if ( inter.dimension() == 2 ) {
-                return INF;
-            }
+        if ( contact->dimension == 1 ) {
+            set.insert( contact->point );
+            nbInter = set.size();
+        }
+        else {
+            nbInter = INF;
         }
     }
 
-    //if (set.size() == 1) DEBUG_TRACE << "one contact point between two rings\n";
-    return set.size();
+    //if (nbInter == 1) DEBUG_TRACE << "one contact point between two rings\n";
+    return nbInter;
 }
 
+//! pairs of interior rings with overlapping boxes
+struct InteriorCandidates {
+    void operator()( const Box2d& a, const Box2d& b ) {
+        pairs.push_back( std::make_pair( std::min( a.ring, b.ring ), std::max( a.ring, b.ring ) ) );
+    }
+
+    std::vector< std::pair< size_t, size_t > > pairs;
+};
+
 // you get usefull output from this
 inline
 const Validity isValid( const Poly& poly, osg::Vec3 base[3], std::unique_ptr<Poly2d> & poly2d, bool fullCheck = true )
@@ -519,9 +845,16 @@ const Validity isValid( const Poly& poly, osg::Vec3 base[3], std::unique_ptr<Pol
     poly2d.reset( new Poly2d( poly, base ) );
 
     if ( fullCheck ) {
+        // all segments pairs are tested at once, those whose boxes overlap
+        SegmentIntersections intersections( *poly2d );
+        {
+            std::vector< Box2d > boxes( segmentBoxes( *poly2d ) );
+            overlappingBoxes( boxes, intersections );
+        }
+
         // Test rings simplicity now
         for ( std::size_t r=0; r<nrings; ++r ) {
-            if ( selfIntersects( poly2d->rings[r] ) ) {
+            if ( intersections.selfIntersects[r] ) {
                 return Validity::invalid( ( boost::format( "ring %d self intersects" ) % r ).str() );
             }
         }
@@ -532,16 +865,19 @@ const Validity isValid( const Poly& poly, osg::Vec3 base[3], std::unique_ptr<Pol
             typedef std::pair<int,int> Edge;
             std::vector<Edge> touchingRings;
 
-            for ( size_t ri=0; ri < nrings; ++ri ) { // no need for numRings-1, the next loop won't be entered for the last ring
-                for ( size_t rj=ri+1; rj < nrings; ++rj ) {
-                    const size_t nbInter = nbIntersections( poly2d->rings[ri], poly2d->rings[rj] );
+            std::vector< RingContact >& contacts = intersections.contacts;
+            std::sort( contacts.begin(), contacts.end() );
 
-                    if ( nbInter > 1 ) {
-                        return Validity::invalid( ( boost::format( "intersection between ring %d and %d" ) % ri % rj ).str() );
-                    }
-                    else if ( nbInter == 1 ) {
-                        touchingRings.push_back( Edge( ri,rj ) );
-                    }
+            for ( std::vector< RingContact >::const_iterator c = contacts.begin(); c != contacts.end(); ) {
+                const size_t ri = c->ri;
+                const size_t rj = c->rj;
+                const size_t nbInter = nbIntersections( c, contacts.end() );
+
+                if ( nbInter > 1 ) {
+                    return Validity::invalid( ( boost::format( "intersection between ring %d and %d" ) % ri % rj ).str() );
+                }
+                else if ( nbInter == 1 ) {
+                    touchingRings.push_back( Edge( ri,rj ) );
                 }
             }
 
@@ -566,17 +902,58 @@ const Validity isValid( const Poly& poly, osg::Vec3 base[3], std::unique_ptr<Pol
 
         // Interior rings must be interior to exterior ring
         // since there is no crossing (tested above), just check that the firs point of int is coverd by ext
-        for ( size_t r=1; r < nrings ; ++r ) {
-            if ( ! isCovered( poly2d->rings[r][0], poly2d->rings[0] ) ) {
-                return Validity::invalid( ( boost::format( "exterior ring doesn't cover interior ring %d" ) % r ).str() );
+        {
+            std::vector< osg::Vec2 > firstPoints;
+
+            for ( size_t r=1; r < nrings ; ++r ) {
+                firstPoints.push_back( poly2d->rings[r][0] );
+            }
+
+            const std::vector< bool > covered( areCovered( firstPoints, poly2d->rings[0] ) );
+
+            for ( size_t r=1; r < nrings ; ++r ) {
+                if ( ! covered[r-1] ) {
+                    return Validity::invalid( ( boost::format( "exterior ring doesn't cover interior ring %d" ) % r ).str() );
+                }
             }
         }
 
         // Interior ring must not cover one another
         // again, since there is no crossing, testing just two point, since one contact point is allowed
         // and it could be the first tested
-        for ( size_t ri=1; ri < nrings; ++ri ) { // no need for numRings-1, the next loop won't be entered for the last ring
-            for ( size_t rj=ri+1; rj < nrings; ++rj ) {
+        // only rings with overlapping boxes can cover one another, the covered ring is inside
+        {
+            std::vector< Box2d > boxes;
+
+            for ( size_t r=1; r < nrings; ++r ) {
+                Box2d box = { FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, r, 0 };
+                const Ring2d& ring = poly2d->rings[r];
+
+                for ( Ring2d::const_iterator p = ring.begin(); p != ring.end(); p++ ) {
+                    box.xmin = std::min( box.xmin, p->x() );
+                    box.ymin = std::min( box.ymin, p->y() );
+                    box.xmax = std::max( box.xmax, p->x() );
+                    box.ymax = std::max( box.ymax, p->y() );
+                }
+
+                // isCovered may round a crossing just above the box
+                const float margin = 2 * FLT_EPSILON * ( 1 + std::max( std::max( std::abs( box.xmin ), std::abs( box.xmax ) ),
+                                                           std::max( std::abs( box.ymin ), std::abs( box.ymax ) ) ) );
+                box.xmin -= margin;
+                box.ymin -= margin;
+                box.xmax += margin;
+                box.ymax += margin;
+                boxes.push_back( box );
+            }
+
+            InteriorCandidates candidates;
+            overlappingBoxes( boxes, candidates );
+            std::sort( candidates.pairs.begin(), candidates.pairs.end() );
+
+            for ( size_t c=0; c < candidates.pairs.size(); c++ ) {
+                const size_t ri = candidates.pairs[c].first;
+                const size_t rj = candidates.pairs[c].second;
+
                 if ( isCovered( poly2d->rings[rj][0], poly2d->rings[ri] ) && isCovered( poly2d->rings[rj][1], poly2d->rings[ri] ) ) {
                     return Validity::invalid( ( boost::format( "interior ring %d covers interior ring %d" ) % ri % rj ).str() );
                 }
@@ -587,12 +964,13 @@ const Validity isValid( const Poly& poly, osg::Vec3 base[3], std::unique_ptr<Pol
     return Validity::valid();
 }
 
-void Mesh::push_back( const LWPOLY* lwpoly )
+// poly2tri does not need a 2D specialisation
+template< bool HAS_Z >
+void Mesh::tessellate()
 {
-    assert( lwpoly );
-    assert( lwpoly->nrings > 0 );
+    assert( _ringSize.size() > 0 );
 
-    Poly poly( lwpoly, _layerToWord );
+    Poly poly( _ringVtx, _ringSize );
     osg::Vec3 base[3];
     std::unique_ptr< Poly2d > poly2d;
     Validity validity( isValid( poly, base, poly2d ) );
@@ -663,21 +1041,33 @@ void Mesh::push_back( const LWPOLY* lwpoly )
     }
 
     std::vector<p2t::Triangle*> triangles( cdt->GetTriangles() );
+    std::map< const p2t::Point*, unsigned > welded;
 
     for ( size_t i = 0; i < triangles.size(); i++ ) {
         p2t::Triangle& t = *triangles[i];
 
         for ( int j=0; j<3; j++ ) {
-            p2t::Point& a = *t.GetPoint( j );
+            const p2t::Point& a = *t.GetPoint( j );
+            std::map< const p2t::Point*, unsigned >::const_iterator found = welded.find( &a );
+
+            if ( found != welded.end() ) {
+                _tri.push_back( found->second );
+                continue;
+            }
+
+            welded[ &a ] = _vtx.size();
             _tri.push_back( _vtx.size() );
             _vtx.push_back( base[0] * a.x + base[1] * a.y + base[2] * distance );
         }
     }
 
-    _nrml.resize( _vtx.size(), normal );
+    if ( _withNormals ) {
+        _nrml.resize( _vtx.size(), normal );
+    }
 }
 
 #else
+#ifdef HAVE_GLU
 // nop callback
 void CALLBACK noStripCB( GLboolean flag )
 {
@@ -707,24 +1097,23 @@ void CALLBACK tessVertexCB( const GLdouble* vtx, void* data )
 {
     // cast back to double type
     Mesh* that = ( Mesh* )data;
-    that->_tri.push_back( that->_vtx.size() );
-    that->_vtx.push_back( osg::Vec3( vtx[0], vtx[1], vtx[2] ) );
-}
+    const osg::Vec3d* ringVtx = reinterpret_cast< const osg::Vec3d* >( vtx );
 
-struct VecGL {
-    GLdouble _comp[3];
-};
-std::list< VecGL > globalVtxForGlu;
+    if ( ringVtx >= &that->_ringVtx[0] && ringVtx < &that->_ringVtx[0] + that->_ringVtx.size() ) {
+        that->_tri.push_back( that->meshVertex( ringVtx - &that->_ringVtx[0] ) );
+    }
+    else {
+        // created by combine
+        that->_tri.push_back( that->_vtx.size() );
+        that->_vtx.push_back( osg::Vec3( vtx[0], vtx[1], vtx[2] ) );
+    }
+}
 
-void CALLBACK tessCombineCB( GLdouble coords[3], GLdouble* /*vertex_data*/[4], GLfloat /*weight*/[4], void** outData, void* /*data*/ )
+void CALLBACK tessCombineCB( GLdouble coords[3], GLdouble* /*vertexData*/[4], GLfloat /*weight*/[4], void** outData, void* data )
 {
-
-    globalVtxForGlu.push_back( VecGL() );
-    GLdouble* vertex = globalVtxForGlu.back()._comp;
-    vertex[0] = coords[0];
-    vertex[1] = coords[1];
-    vertex[2] = coords[2];
-    *outData = vertex;
+    Mesh* that = ( Mesh* )data;
+    that->_combinedVtx.push_back( osg::Vec3d( coords[0], coords[1], coords[2] ) );
+    *outData = that->_combinedVtx.back().ptr();
 }
 
 // for RAII off GLUtesselator
@@ -747,120 +1136,216 @@ struct Tessellator {
     GLUtesselator* _tess;
 };
 
-template<>
-void Mesh::push_back( const LWPOLY* lwpoly )
+// glu copes with self intersections and degenerated rings, native triangulation is
+// tried first since it is much faster, especially on quads and other convex polygons
+void Mesh::gluTessellate()
 {
-    assert( lwpoly );
-
-    const int numRings = lwpoly->nrings;
-
-    if ( numRings == 0 ) {
-        return;
-    }
-
-    size_t totalNumVtx = 0;
-
-    for ( int r = 0; r < numRings; r++ ) {
-        totalNumVtx += lwpoly->rings[r]->npoints;
-    }
-
-    std::vector< GLdouble > coord( totalNumVtx*3 );
-
+    const size_t numRings = _ringSize.size();
     const size_t size = _tri.size();
-    assert( _vtx.size() == size );
+    const size_t numVtx = _vtx.size();
 
     try {
         // retesselate and add rings
         Tessellator tesselator ;
         gluTessBeginPolygon( tesselator._tess, this ); // with NULL data
-        size_t currIdx = 0;
+        size_t ringBegin = 0;
 
-        for ( int r = 0; r < numRings; r++ ) {
+        for ( size_t r = 0; r < numRings; r++ ) {
             gluTessBeginContour( tesselator._tess );                    // outer quad
-            const int ringSize = lwpoly->rings[r]->npoints;
-
-            for( int v = 0; v < ringSize - 1; v++ ) {
-                const POINT3DZ p3D = getPoint3dz( lwpoly->rings[r], v );
-                const osg::Vec3 p = osg::Vec3( p3D.x, p3D.y, p3D.z ) * _layerToWord;
-                coord[currIdx + 0] = p.x();
-                coord[currIdx + 1] = p.y();
-                coord[currIdx + 2] = p.z();
-                gluTessVertex( tesselator._tess, &( coord[currIdx] ), &( coord[currIdx] ) );
-                currIdx+=3;
+            const size_t ringEnd = ringBegin + _ringSize[r];
+
+            // the last point of the ring duplicates the first
+            for( size_t v = ringBegin; v + 1 < ringEnd; v++ ) {
+                gluTessVertex( tesselator._tess, _ringVtx[v].ptr(), _ringVtx[v].ptr() );
             }
 
             gluTessEndContour( tesselator._tess );                    // outer quad
+            ringBegin = ringEnd;
         }
 
         gluTessEndPolygon( tesselator._tess );
-        globalVtxForGlu.clear(); // should keep allocated (reserved memory)
+        _combinedVtx.clear();
     }
     catch ( std::exception& e ) {
-        std::cerr << "warnig: cannot tesselate polygon: " << e.what() << "\n";
+        std::cerr << "warning: cannot tessellate polygon: " << e.what() << "\n";
+        _numDroppedPolygons++;
         // undo modifications to _tri and _vtx
         _tri.resize( size );
-        _vtx.resize( size );
-        globalVtxForGlu.clear(); // should keep allocated (reserved memory)
+        _vtx.resize( numVtx );
+        _combinedVtx.clear();
     }
+}
+#endif
 
+// 2D polygons are horizontal: the triangulation is done in XY and faces up, there is
+// no normal to compute
+template< bool HAS_Z >
+void Mesh::tessellate()
+{
+    assert( _ringSize.size() );
 
-    //// Normal computation.
-    ////
-    //// We cannot accurately rely on triangles from the tessellation, since we could have
-    //// very "degraded" triangles (close to a line), and the normal computation would be bad.
-    //// In this case, we would have to average the normal vector over each triangle of the polygon.
-    //// The Newell's formula is simpler and more direct here.
-    osg::Vec3 normal( 0.0, 0.0, 0.0 );
-    const int sz = lwpoly->rings[0]->npoints;
+    const size_t size = _tri.size();
+    _ringToMesh.assign( _ringVtx.size(), NO_VERTEX );
 
-    for ( int i = 0; i < sz; ++i ) {
-        const POINT3DZ p3Di = getPoint3dz( lwpoly->rings[0], i );
-        const POINT3DZ p3Dj = getPoint3dz( lwpoly->rings[0], ( i+1 ) % sz );
-        const osg::Vec3 pi= osg::Vec3( p3Di.x, p3Di.y, p3Di.z ) * _layerToWord;
-        const osg::Vec3 pj= osg::Vec3( p3Dj.x, p3Dj.y, p3Dj.z ) * _layerToWord;
-        normal[0] += ( pi[1] - pj[1] ) * ( pi[2] + pj[2] );
-        normal[1] += ( pi[2] - pj[2] ) * ( pi[0] + pj[0] );
-        normal[2] += ( pi[0] - pj[0] ) * ( pi[1] + pj[1] );
-    }
+    const bool triangulated = HAS_Z
+                              ? _triangulator( _ringVtx, _ringSize, _tri )
+                              : _triangulator.horizontal( _ringVtx, _ringSize, _tri );
 
-    normal.normalize();
+    if ( triangulated ) {
+        // indices refer to ring vertices
+        for ( size_t i = size; i < _tri.size(); i++ ) {
+            _tri[i] = meshVertex( _tri[i] );
+        }
+    }
+    else {
+#ifdef HAVE_GLU
+        gluTessellate();
+#else
+        std::cerr << "warning: cannot tessellate degenerated polygon\n";
+        _numDroppedPolygons++;
+#endif
+    }
 
-    if ( ( FLAGS_GET_Z( lwpoly->flags ) == 0 ) && ( normal[2] < 0 ) ) {
-        // if this is a 2D surface and the normal is pointing down, reverse each new triangle
-        normal[2] = 1;
+    osg::Vec3 normal( 0, 0, 1 );
 
+    if ( HAS_Z ) {
+        //// Normal computation.
+        ////
+        //// We cannot accurately rely on triangles from the tessellation, since we could have
+        //// very "degraded" triangles (close to a line), and the normal computation would be bad.
+        //// In this case, we would have to average the normal vector over each triangle of the polygon.
+        //// The Newell's formula is simpler and more direct here.
+        normal = newellNormal( &_ringVtx[0], _ringSize[0] );
+    }
+    else if ( !triangulated && newellNormal( &_ringVtx[0], _ringSize[0] )[2] < 0 ) {
+        // glu triangles have the orientation of the exterior ring, reverse them to face up
         for ( size_t i = size/3; i < _tri.size() / 3; ++i ) {
             std::swap( _tri[3*i], _tri[3*i+2] );
         }
     }
 
-    _nrml.resize( _vtx.size(), normal );
-
+    if ( _withNormals ) {
+        _nrml.resize( _vtx.size(), normal );
+    }
 }
 #endif
 
+void Mesh::endPolygon()
+{
+    if ( _extruding ) {
+        extrudePolygon();
+    }
+    else if ( _hasZ ) {
+        tessellate< true >();
+    }
+    else {
+        tessellate< false >();
+    }
+}
 
 
-// we create the box triangles ourselves since an osg::Box for each feature is really slow
-void Mesh::addBar( WKB center, float width, float depth, float height )
+
+void Mesh::addBarInstance( WKB center, float width, float height )
 {
+    HexInput input( center.get() );
+    WkbReader< HexInput > reader( input );
+    _barPos.push_back( reader.point() * _layerToWord );
+    _barSize.push_back( osg::Vec2( width, height ) );
+}
 
-    Lwgeom lwgeom( center );
+void Mesh::addBarInstance( BinaryWKB center, float width, float height )
+{
+    BinaryInput input( center.get(), center.size() );
+    WkbReader< BinaryInput > reader( input );
+    _barPos.push_back( reader.point() * _layerToWord );
+    _barSize.push_back( osg::Vec2( width, height ) );
+}
 
-    if ( !lwgeom.get() ) {
-        return;    // the error reporter takes care of errors
-    }
+void Mesh::releaseExtrusions( std::vector< std::pair< unsigned, unsigned > >& ranges )
+{
+    ranges.swap( _extrusions );
+    _extrusions.clear();
+}
+
+void Mesh::releaseBarInstances( osg::Vec3Array& positions, osg::Vec2Array& sizes, osg::UIntArray& ids )
+{
+    positions.asVector().swap( _barPos );
+    sizes.asVector().swap( _barSize );
+    _barFid.releaseTo( ids, positions.size() );
+    _barPos.clear();
+    _barSize.clear();
+}
 
-    LWPOINT* lwpoint = lwgeom_as_lwpoint( lwgeom.get() );
+namespace {
+//! adds a model instance at each point streamed by WkbReader::points()
+struct ModelInstances {
+    ModelInstances( const osg::Matrixd& layerToWord, const osg::Vec2& scaleRotation,
+                    std::vector<osg::Vec3>& positions, std::vector<osg::Vec2>& scaleRotations )
+        : _layerToWord( layerToWord )
+        , _scaleRotation( scaleRotation )
+        , _positions( positions )
+        , _scaleRotations( scaleRotations )
+    {}
 
-    if( !lwpoint ) {
-        throw std::runtime_error( "failed to get points from WKB" );
+    void point( const osg::Vec3d& p ) {
+        if ( p.x() != p.x() ) {
+            return; // empty points have NaN coordinates
+        }
+
+        _positions.push_back( p * _layerToWord );
+        _scaleRotations.push_back( _scaleRotation );
     }
 
-    const POINT3DZ p = getPoint3dz( lwpoint->point, 0 );
+private:
+    const osg::Matrixd& _layerToWord;
+    const osg::Vec2 _scaleRotation;
+    std::vector<osg::Vec3>& _positions;
+    std::vector<osg::Vec2>& _scaleRotations;
+};
+}
+
+void Mesh::addModelInstances( WKB points, float scale, float rotation )
+{
+    HexInput input( points.get() );
+    WkbReader< HexInput > reader( input );
+    ModelInstances instances( _layerToWord, osg::Vec2( scale, osg::DegreesToRadians( rotation ) ), _modelPos, _modelScaleRotation );
+    reader.points( instances );
+}
+
+void Mesh::addModelInstances( BinaryWKB points, float scale, float rotation )
+{
+    BinaryInput input( points.get(), points.size() );
+    WkbReader< BinaryInput > reader( input );
+    ModelInstances instances( _layerToWord, osg::Vec2( scale, osg::DegreesToRadians( rotation ) ), _modelPos, _modelScaleRotation );
+    reader.points( instances );
+}
 
-    const osg::Vec3 ctr( p.x, p.y, p.z );
+void Mesh::releaseModelInstances( osg::Vec3Array& positions, osg::Vec2Array& scaleRotations, osg::UIntArray& ids )
+{
+    positions.asVector().swap( _modelPos );
+    scaleRotations.asVector().swap( _modelScaleRotation );
+    _modelFid.releaseTo( ids, positions.size() );
+    _modelPos.clear();
+    _modelScaleRotation.clear();
+}
 
+// we create the box triangles ourselves since an osg::Box for each feature is really slow
+void Mesh::addBar( WKB center, float width, float depth, float height )
+{
+    HexInput input( center.get() );
+    WkbReader< HexInput > reader( input );
+    addBar( reader.point(), width, depth, height );
+}
+
+void Mesh::addBar( BinaryWKB center, float width, float depth, float height )
+{
+    BinaryInput input( center.get(), center.size() );
+    WkbReader< BinaryInput > reader( input );
+    addBar( reader.point(), width, depth, height );
+}
+
+void Mesh::addBar( const osg::Vec3d& ctr, float width, float depth, float height )
+{
     // we build a bevelled box, without a bottom
     // it's base is centerd on origin
 
@@ -924,15 +1409,17 @@ void Mesh::addBar( WKB center, float width, float depth, float height )
 
     _vtx.insert( _vtx.end(), vb, vb+8 );
 
-    _nrml.insert( _nrml.end(), nb, nb+8 );
-
     _vtx.insert( _vtx.end(), vt, vt+8 );
 
-    _nrml.insert( _nrml.end(), nb, nb+8 ); // same nrml as bottom
-
     _vtx.insert( _vtx.end(), vc, vc+4 );
 
-    _nrml.insert( _nrml.end(), nc, nc+4 );
+    if ( _withNormals ) {
+        _nrml.insert( _nrml.end(), nb, nb+8 );
+
+        _nrml.insert( _nrml.end(), nb, nb+8 ); // same nrml as bottom
+
+        _nrml.insert( _nrml.end(), nc, nc+4 );
+    }
 
     // sides, loop / indices
     for ( size_t i=0; i<8; i++ ) {
@@ -972,50 +1459,131 @@ void Mesh::addBar( WKB center, float width, float depth, float height )
     // translate all vtx by base center
     const osg::Vec3 bc = ctr*_layerToWord;
     const size_t sz = _vtx.size();
-    assert( _vtx.size() - o == 20 );
+    assert( _vtx.size() - o == BAR_VERTICES );
+    _extrusions.push_back( std::make_pair( o, unsigned( sz ) ) );
 
     for ( size_t i=o; i<sz; i++ ) {
         _vtx[i] += bc;
     }
 }
 
-template<>
-void Mesh::push_back( const LWTRIANGLE* lwtriangle )
+void Mesh::endTriangle()
 {
-    assert( lwtriangle );
-    const int offset = _vtx.size();
+    assert( _ringSize.size() == 1 );
 
-    for( int v = 0; v < 3; v++ ) {
-        const POINT3DZ p3D = getPoint3dz( lwtriangle->points, v );
-        const osg::Vec3d p( p3D.x, p3D.y, p3D.z );
-        _vtx.push_back( p * _layerToWord );
+    if ( _extruding ) {
+        extrudePolygon();
+        return;
     }
 
-    for ( int i=0; i<3; i++ ) {
-        _tri.push_back( i + offset );
+    if ( _ringVtx.size() < 3 ) {
+        throw std::runtime_error( "not enough points in triangle" );
     }
 
-    osg::Vec3 normal( 0.0, 0.0, 0.0 );
+    const unsigned offset = _vtx.size();
+    const size_t triOffset = _tri.size();
 
-    for ( int i = 0; i < 3; ++i ) {
-        osg::Vec3 pi = _vtx[offset+i];
-        osg::Vec3 pj = _vtx[offset +( ( i+1 ) % 3 ) ];
-        normal[0] += ( pi[1] - pj[1] ) * ( pi[2] + pj[2] );
-        normal[1] += ( pi[2] - pj[2] ) * ( pi[0] + pj[0] );
-        normal[2] += ( pi[0] - pj[0] ) * ( pi[1] + pj[1] );
+    for( int v = 0; v < 3; v++ ) {
+        _vtx.push_back( _ringVtx[v] );
+        _tri.push_back( offset + v );
     }
 
-    normal.normalize();
+    osg::Vec3 normal( newellNormal( &_ringVtx[0], 3 ) );
 
-    if ( ( FLAGS_GET_Z( lwtriangle->flags ) == 0 ) && ( normal[2] < 0 ) ) {
+    if ( !_hasZ && ( normal[2] < 0 ) ) {
         // if this is a 2D surface and the normal is pointing down, reverse the triangle
         normal[2] = 1;
-        std::swap( _tri[ offset ], _tri[offset + 2] );
+        std::swap( _tri[ triOffset ], _tri[ triOffset + 2 ] );
+    }
+
+    if ( _withNormals ) {
+        _nrml.resize( _vtx.size(), normal );
+    }
+}
+
+// consecutive duplicated points are skipped, a line without length adds nothing
+void Mesh::endLine()
+{
+    assert( _ringSize.size() == 1 );
+    const size_t first = _lineVtx.size();
+
+    for ( size_t i = 0; i < _ringVtx.size(); i++ ) {
+        const osg::Vec3 v( _ringVtx[i] );
+
+        if ( _lineVtx.size() > first ) {
+            if ( _lineVtx.back() == v ) {
+                continue;
+            }
+
+            _lineIdx.push_back( _lineVtx.size() - 1 );
+            _lineIdx.push_back( _lineVtx.size() );
+        }
+
+        _lineVtx.push_back( v );
+    }
+
+    if ( _lineVtx.size() == first + 1 ) {
+        _lineVtx.pop_back();
     }
+}
+
+#ifdef HAVE_LWGEOM
+template<>
+void Mesh::push_back( const LWPOLY* lwpoly )
+{
+    assert( lwpoly );
+
+    const int numRings = lwpoly->nrings;
+
+    if ( numRings == 0 ) {
+        return;
+    }
+
+    beginPolygon( FLAGS_GET_Z( lwpoly->flags ) != 0 );
+
+    for ( int r = 0; r < numRings; r++ ) {
+        const int ringSize = lwpoly->rings[r]->npoints;
+        beginRing( ringSize );
+
+        for( int v = 0; v < ringSize; v++ ) {
+            const POINT3DZ p3D = getPoint3dz( lwpoly->rings[r], v );
+            vertex( osg::Vec3d( p3D.x, p3D.y, p3D.z ) );
+        }
+    }
+
+    endPolygon();
+}
+
+template<>
+void Mesh::push_back( const LWTRIANGLE* lwtriangle )
+{
+    assert( lwtriangle );
+    const int ringSize = lwtriangle->points->npoints;
+    beginPolygon( FLAGS_GET_Z( lwtriangle->flags ) != 0 );
+    beginRing( ringSize );
+
+    for( int v = 0; v < ringSize; v++ ) {
+        const POINT3DZ p3D = getPoint3dz( lwtriangle->points, v );
+        vertex( osg::Vec3d( p3D.x, p3D.y, p3D.z ) );
+    }
+
+    endTriangle();
+}
 
-    for ( int i=0; i<3; i++ ) {
-        _nrml.push_back( normal );
+template<>
+void Mesh::push_back( const LWLINE* lwline )
+{
+    assert( lwline );
+    const int numPoints = lwline->points->npoints;
+    beginPolygon( FLAGS_GET_Z( lwline->flags ) != 0 );
+    beginRing( numPoints );
+
+    for( int v = 0; v < numPoints; v++ ) {
+        const POINT3DZ p3D = getPoint3dz( lwline->points, v );
+        vertex( osg::Vec3d( p3D.x, p3D.y, p3D.z ) );
     }
+
+    endLine();
 }
 
 template< typename MULTITYPE >
@@ -1059,39 +1627,317 @@ void Mesh::push_back( const LWGEOM* lwgeom )
     case POLYGONTYPE:
         push_back( lwgeom_as_lwpoly( lwgeom ) );
         break;
+    case LINETYPE:
+        push_back( lwgeom_as_lwline( lwgeom ) );
+        break;
+    case MULTILINETYPE:
+        push_back( lwgeom_as_lwmline( lwgeom ) );
+        break;
     case POINTTYPE:
         throw std::runtime_error( "POINTTYPE not handled" );
     case MULTIPOINTTYPE:
         throw std::runtime_error( "MULTIPOINTTYPE not handled" );
-    case LINETYPE:
-        throw std::runtime_error( "LINETYPE not handled" );
-    case MULTILINETYPE:
-        throw std::runtime_error( "MULTILINETYPE not handled" );
     case MULTISURFACETYPE:
-        throw std::runtime_error( "MULTISURFACETYPE not handled" );
     case MULTICURVETYPE:
-        throw std::runtime_error( "MULTICURVETYPE not handled" );
     case CIRCSTRINGTYPE:
-        throw std::runtime_error( "CIRCSTRINGTYPE not handled" );
     case COMPOUNDTYPE:
-        throw std::runtime_error( "COMPOUNDTYPE not handled" );
-    case CURVEPOLYTYPE:
-        throw std::runtime_error( "CURVEPOLYTYPE not handled" );
+    case CURVEPOLYTYPE: {
+        // linearized by WkbReader, the same way as postgis results
+        size_t size = 0;
+        const std::unique_ptr< uint8_t, void( * )( void* ) > wkb( lwgeom_to_wkb( lwgeom, WKB_EXTENDED, &size ), free );
+
+        if ( !wkb ) {
+            throw std::runtime_error( "from liblwgeom: cannot convert curve to WKB" );
+        }
+
+        push_back( BinaryWKB( reinterpret_cast< const char* >( wkb.get() ), size ) );
+    }
+    break;
     }
 }
 
+#endif
+
 void Mesh::push_back( WKT wkt )
 {
+#ifdef HAVE_LWGEOM
     Lwgeom lwgeom( wkt );
-    assert( lwgeom.get() ); // error reporter will take care of errors
     push_back( lwgeom.get() );
+#else
+    ( void )wkt;
+    throw std::runtime_error( "WKT input needs liblwgeom" );
+#endif
 }
 
 void Mesh::push_back( WKB wkb )
 {
-    Lwgeom lwgeom( wkb );
-    assert( lwgeom.get() ); // error reporter will take care of errors
-    push_back( lwgeom.get() );
+    HexInput input( wkb.get() );
+    WkbReader< HexInput > reader( input, _arcTolerance );
+    reader.read( *this );
+}
+
+void Mesh::push_back( BinaryWKB wkb )
+{
+    BinaryInput input( wkb.get(), wkb.size() );
+    WkbReader< BinaryInput > reader( input, _arcTolerance );
+    reader.read( *this );
+}
+
+// walls along the ring edges, then the footprint raised by the height as a roof
+void Mesh::extrudePolygon()
+{
+    const osg::Vec3d up = osg::Vec3d( 0, 0, _height ) * _layerToWord - osg::Vec3d() * _layerToWord;
+    size_t ringBegin = 0;
+
+    for ( size_t r = 0; r < _ringSize.size(); r++ ) {
+        const size_t ringEnd = ringBegin + _ringSize[r];
+
+        // walls face outward if the exterior ring is counterclockwise seen from above
+        // and holes are clockwise
+        double doubleArea = 0;
+
+        for ( size_t i = ringBegin; i + 1 < ringEnd; i++ ) {
+            doubleArea += _ringVtx[i].x() * _ringVtx[i+1].y() - _ringVtx[i+1].x() * _ringVtx[i].y();
+        }
+
+        const bool reverse = ( doubleArea < 0 ) == ( r == 0 );
+
+        for ( size_t i = ringBegin; i + 1 < ringEnd; i++ ) {
+            const osg::Vec3d& a = _ringVtx[ reverse ? i + 1 : i ];
+            const osg::Vec3d& b = _ringVtx[ reverse ? i : i + 1 ];
+            osg::Vec3 normal( b.y() - a.y(), a.x() - b.x(), 0 );
+
+            if ( normal.length2() <= 0 ) {
+                continue; // duplicated point
+            }
+
+            normal.normalize();
+
+            const unsigned offset = _vtx.size();
+            _vtx.push_back( a );
+            _vtx.push_back( b );
+            _vtx.push_back( b + up );
+            _vtx.push_back( a + up );
+
+            const unsigned quad[] = {0, 1, 2, 0, 2, 3};
+
+            for ( size_t q = 0; q < 6; q++ ) {
+                _tri.push_back( offset + quad[q] );
+            }
+
+            if ( _withNormals ) {
+                _nrml.resize( _vtx.size(), normal );
+            }
+        }
+
+        ringBegin = ringEnd;
+    }
+
+    for ( std::vector<osg::Vec3d>::iterator v = _ringVtx.begin(); v != _ringVtx.end(); v++ ) {
+        *v += up;
+    }
+
+    tessellate< false >();
+}
+
+template< typename INPUT >
+void Mesh::extrude( INPUT& input, float base, float height )
+{
+    _extruding = true;
+    _base = base;
+    _height = height;
+    const unsigned first = unsigned( _vtx.size() );
+
+    try {
+        WkbReader< INPUT > reader( input, _arcTolerance );
+        reader.read( *this );
+    }
+    catch ( std::exception& ) {
+        _extruding = false;
+        throw;
+    }
+
+    _extruding = false;
+
+    if ( _vtx.size() > first ) {
+        _extrusions.push_back( std::make_pair( first, unsigned( _vtx.size() ) ) );
+    }
+}
+
+void Mesh::extrude( WKB footprint, float base, float height )
+{
+    HexInput input( footprint.get() );
+    extrude( input, base, height );
+}
+
+void Mesh::extrude( BinaryWKB footprint, float base, float height )
+{
+    BinaryInput input( footprint.get(), footprint.size() );
+    extrude( input, base, height );
+}
+
+namespace {
+// a polygon of n points (closing ones included) and r rings has at most n - r vertices
+// and n + r - 4 triangles, its extrusion adds at most n - r quads
+template< typename INPUT >
+void estimateSurfaces( INPUT& input, size_t& numVertices, size_t& numIndices, bool extruded )
+{
+    WkbReader< INPUT > reader( input );
+    size_t numPoints = 0;
+    size_t numRings = 0;
+
+    try {
+        if ( !reader.count( numPoints, numRings ) ) {
+            return; // push_back will report it
+        }
+    }
+    catch ( std::exception& ) {
+        return; // truncated, push_back will report it
+    }
+
+    numVertices += numPoints;
+    numIndices += 3 * ( numPoints + numRings );
+
+    if ( extruded ) {
+        numVertices += 4 * numPoints;
+        numIndices += 6 * numPoints;
+    }
+}
+}
+
+void Mesh::estimate( WKB geometry, size_t& numVertices, size_t& numIndices, bool extruded )
+{
+    HexInput input( geometry.get() );
+    estimateSurfaces( input, numVertices, numIndices, extruded );
+}
+
+void Mesh::estimate( BinaryWKB geometry, size_t& numVertices, size_t& numIndices, bool extruded )
+{
+    BinaryInput input( geometry.get(), geometry.size() );
+    estimateSurfaces( input, numVertices, numIndices, extruded );
+}
+
+void Mesh::reserve( size_t numVertices, size_t numIndices )
+{
+    if ( _vtx.size() + numVertices > _vtx.capacity() ) {
+        const size_t capacity = std::max( _vtx.size() + numVertices, 2 * _vtx.capacity() );
+        _vtx.reserve( capacity );
+
+        if ( _withNormals ) {
+            _nrml.reserve( capacity );
+        }
+
+        _fid.reserve( capacity );
+        _class.reserve( capacity );
+    }
+
+    if ( _tri.size() + numIndices > _tri.capacity() ) {
+        _tri.reserve( std::max( _tri.size() + numIndices, 2 * _tri.capacity() ) );
+    }
+}
+
+void Mesh::FeatureAttribute::set( unsigned value, size_t numVertices )
+{
+    _values.resize( numVertices, _current );
+    _current = value;
+    _used = true;
+}
+
+void Mesh::FeatureAttribute::append( const FeatureAttribute& other, size_t numVertices, size_t otherNumVertices )
+{
+    if ( _used || other._used ) {
+        _values.resize( numVertices, _current );
+        _values.insert( _values.end(), other._values.begin(), other._values.end() );
+        _values.resize( numVertices + otherNumVertices, other._current );
+        _used = true;
+    }
+}
+
+void Mesh::FeatureAttribute::reserve( size_t capacity )
+{
+    if ( _used ) {
+        _values.reserve( capacity );
+    }
+}
+
+void Mesh::FeatureAttribute::addTo( osg::Geometry& geom, unsigned attribute, size_t numVertices ) const
+{
+    if ( _used ) {
+        osg::ref_ptr<osg::UIntArray> values( new osg::UIntArray( _values.begin(), _values.end() ) );
+        values->resize( numVertices, _current );
+        geom.setVertexAttribArray( attribute, values.get() );
+        geom.setVertexAttribBinding( attribute, osg::Geometry::BIND_PER_VERTEX );
+    }
+}
+
+void Mesh::FeatureAttribute::releaseTo( osg::Geometry& geom, unsigned attribute, size_t numVertices )
+{
+    if ( _used ) {
+        osg::ref_ptr<osg::UIntArray> values( new osg::UIntArray );
+        releaseTo( *values, numVertices );
+        geom.setVertexAttribArray( attribute, values.get() );
+        geom.setVertexAttribBinding( attribute, osg::Geometry::BIND_PER_VERTEX );
+    }
+}
+
+void Mesh::FeatureAttribute::releaseTo( osg::UIntArray& values, size_t numVertices )
+{
+    if ( _used ) {
+        _values.resize( numVertices, _current );
+        values.asVector().swap( _values );
+        _values.clear();
+    }
+}
+
+void Mesh::setFeatureId( unsigned id )
+{
+    _fid.set( id, _vtx.size() );
+    _lineFid.set( id, _lineVtx.size() );
+    _barFid.set( id, _barPos.size() );
+    _modelFid.set( id, _modelPos.size() );
+}
+
+void Mesh::setFeatureClass( unsigned index )
+{
+    _class.set( index, _vtx.size() );
+}
+
+void Mesh::append( const Mesh& other )
+{
+    const unsigned offset = unsigned( _vtx.size() );
+    _fid.append( other._fid, _vtx.size(), other._vtx.size() );
+    _class.append( other._class, _vtx.size(), other._vtx.size() );
+
+    _vtx.insert( _vtx.end(), other._vtx.begin(), other._vtx.end() );
+    _nrml.insert( _nrml.end(), other._nrml.begin(), other._nrml.end() );
+    _tri.reserve( _tri.size() + other._tri.size() );
+
+    for ( std::vector<unsigned>::const_iterator i = other._tri.begin(); i != other._tri.end(); i++ ) {
+        _tri.push_back( *i + offset );
+    }
+
+    _lineFid.append( other._lineFid, _lineVtx.size(), other._lineVtx.size() );
+    _barFid.append( other._barFid, _barPos.size(), other._barPos.size() );
+    _modelFid.append( other._modelFid, _modelPos.size(), other._modelPos.size() );
+
+    const unsigned lineOffset = unsigned( _lineVtx.size() );
+    _lineVtx.insert( _lineVtx.end(), other._lineVtx.begin(), other._lineVtx.end() );
+    _lineIdx.reserve( _lineIdx.size() + other._lineIdx.size() );
+
+    for ( std::vector<unsigned>::const_iterator i = other._lineIdx.begin(); i != other._lineIdx.end(); i++ ) {
+        _lineIdx.push_back( *i + lineOffset );
+    }
+
+    _barPos.insert( _barPos.end(), other._barPos.begin(), other._barPos.end() );
+    _barSize.insert( _barSize.end(), other._barSize.begin(), other._barSize.end() );
+    _modelPos.insert( _modelPos.end(), other._modelPos.begin(), other._modelPos.end() );
+    _modelScaleRotation.insert( _modelScaleRotation.end(), other._modelScaleRotation.begin(), other._modelScaleRotation.end() );
+
+    for ( std::vector< std::pair< unsigned, unsigned > >::const_iterator e = other._extrusions.begin(); e != other._extrusions.end(); e++ ) {
+        _extrusions.push_back( std::make_pair( e->first + offset, e->second + offset ) );
+    }
+
+    _numDroppedPolygons += other._numDroppedPolygons;
 }
 
 osg::Geometry* Mesh::createGeometry() const
@@ -1101,13 +1947,61 @@ osg::Geometry* Mesh::createGeometry() const
 
     osg::ref_ptr<osg::Vec3Array> vertices( new osg::Vec3Array( _vtx.begin(), _vtx.end() ) );
     multi->setVertexArray( vertices.get() );
-    osg::ref_ptr<osg::Vec3Array> normals( new osg::Vec3Array( _nrml.begin(), _nrml.end() ) );
-    multi->setNormalArray( normals.get() );
-    multi->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+
+    if ( _withNormals ) {
+        osg::ref_ptr<osg::Vec3Array> normals( new osg::Vec3Array( _nrml.begin(), _nrml.end() ) );
+        multi->setNormalArray( normals.get() );
+        multi->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+    }
+
+    _fid.addTo( *multi, FEATURE_ID_ATTRIBUTE, _vtx.size() );
+    _class.addTo( *multi, CLASS_ATTRIBUTE, _vtx.size() );
 
     osg::ref_ptr<osg::DrawElementsUInt> elem = new osg::DrawElementsUInt( GL_TRIANGLES, _tri.begin(), _tri.end() );
     multi->addPrimitiveSet( elem.get() );
     return multi.release();
 }
 
+osg::Geometry* Mesh::releaseGeometry()
+{
+    osg::ref_ptr<osg::Geometry> multi = new osg::Geometry();
+    multi->setUseVertexBufferObjects( true );
+
+    // osg arrays are std::vector underneath, buffers are swapped
+    osg::ref_ptr<osg::Vec3Array> vertices( new osg::Vec3Array );
+    vertices->asVector().swap( _vtx );
+    multi->setVertexArray( vertices.get() );
+
+    if ( _withNormals ) {
+        osg::ref_ptr<osg::Vec3Array> normals( new osg::Vec3Array );
+        normals->asVector().swap( _nrml );
+        multi->setNormalArray( normals.get() );
+        multi->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+    }
+
+    _fid.releaseTo( *multi, FEATURE_ID_ATTRIBUTE, vertices->size() );
+    _class.releaseTo( *multi, CLASS_ATTRIBUTE, vertices->size() );
+
+    osg::ref_ptr<osg::DrawElementsUInt> elem = new osg::DrawElementsUInt( GL_TRIANGLES );
+    elem->asVector().swap( _tri );
+    multi->addPrimitiveSet( elem.get() );
+    return multi.release();
+}
+
+osg::Geometry* Mesh::releaseLines()
+{
+    osg::ref_ptr<osg::Geometry> lines = new osg::Geometry();
+    lines->setUseVertexBufferObjects( true );
+
+    osg::ref_ptr<osg::Vec3Array> vertices( new osg::Vec3Array );
+    vertices->asVector().swap( _lineVtx );
+    lines->setVertexArray( vertices.get() );
+    _lineFid.releaseTo( *lines, FEATURE_ID_ATTRIBUTE, vertices->size() );
+
+    osg::ref_ptr<osg::DrawElementsUInt> elem = new osg::DrawElementsUInt( GL_LINES );
+    elem->asVector().swap( _lineIdx );
+    lines->addPrimitiveSet( elem.get() );
+    return lines.release();
+}
+
 }
@@ -23,8 +23,13 @@
 #define CALLBACK
 #endif
 
+#include "Triangulator.h"
+
 #include <osg/Geometry>
 
+#include <list>
+#include <utility>
+
 namespace osgGIS {
 
 //! just encapsulate a cont char * to give it a type since
@@ -42,38 +47,247 @@ private :
 struct WKT: ConstCharWrapper {
     WKT( const char* data ): ConstCharWrapper( data ) {}
 };
+//! hex encoded (E)WKB, as returned by postgis in text mode
 struct WKB: ConstCharWrapper {
     WKB( const char* data ): ConstCharWrapper( data ) {}
 };
+//! raw binary (E)WKB, as returned by postgis in binary mode
+struct BinaryWKB: ConstCharWrapper {
+    BinaryWKB( const char* data, size_t size ): ConstCharWrapper( data ), _size( size ) {}
+    size_t size() const {
+        return _size;
+    }
+private :
+    size_t _size ;
+};
+
+template< typename INPUT > struct WkbReader;
 
 //! @brief build an osg::Geometry from WKT or WKB represenations
 //! @note this structure avoids the creation of many small osg::geometries (slow)
 struct Mesh {
     //! @param layerToWord transformation from GIS CRS (layer) to OpenGL scene (world)
     //!        the aim is mainly to center the scene around origin to avoid round-off errors
-    Mesh( const osg::Matrixd& layerToWord )
+    //! @param withNormals false for flat shaded layers, the geometry has no normal array
+    //!        and lighting relies on a shader deriving face normals (see Shaders.h)
+    //! @param arcTolerance maximum distance between curves and their segments, in layer
+    //!        units, 0 for the finest tessellation (see WkbReader)
+    Mesh( const osg::Matrixd& layerToWord, bool withNormals = true, double arcTolerance = 0 )
         : _layerToWord( layerToWord )
+        , _withNormals( withNormals )
+        , _arcTolerance( arcTolerance )
+        , _hasZ( false )
+        , _extruding( false )
+        , _base( 0 )
+        , _height( 0 )
+        , _numDroppedPolygons( 0 )
     {}
 
 
+    //! the vertices added next belong to feature id, the geometries of the mesh then
+    //! have a per vertex id attribute (FEATURE_ID_ATTRIBUTE of Shaders.h), lines too,
+    //! and bar and model instances are released with their ids
+    void setFeatureId( unsigned id );
+
+    //! the vertices added next belong to class index (below MAX_CLASSES of Shaders.h),
+    //! the geometries of the mesh then have a per vertex CLASS_ATTRIBUTE
+    //! @note lines and instances have no class
+    void setFeatureClass( unsigned index );
+
+    //! @note WKB and BinaryWKB are decoded natively, WKT needs liblwgeom
     void push_back( WKB geometry );
+    void push_back( BinaryWKB geometry );
     void push_back( WKT geometry );
 
     void addBar( WKB center, float width, float depth, float height );
+    void addBar( BinaryWKB center, float width, float depth, float height );
+
+    //! records a bar drawn by instancing instead of adding its box, see InstancedBars.h
+    void addBarInstance( WKB center, float width, float height );
+    void addBarInstance( BinaryWKB center, float width, float height );
+
+    size_t numBarInstances() const {
+        return _barPos.size();
+    }
+
+    //! hands the bar instances to the arrays without copy, none are left in the mesh
+    //! @param positions base centers in world coordinates
+    //! @param sizes width and height
+    //! @param ids feature ids, left empty if setFeatureId() has not been called
+    void releaseBarInstances( osg::Vec3Array& positions, osg::Vec2Array& sizes, osg::UIntArray& ids );
+
+    //! records a model instance at each point of a POINT or MULTIPOINT, see InstancedModels.h
+    //! @param rotation around the vertical axis, counterclockwise in degrees
+    void addModelInstances( WKB points, float scale, float rotation );
+    void addModelInstances( BinaryWKB points, float scale, float rotation );
+
+    size_t numModelInstances() const {
+        return _modelPos.size();
+    }
+
+    //! hands the model instances to the arrays without copy, none are left in the mesh
+    //! @param positions in world coordinates
+    //! @param scaleRotations scale and rotation in radians
+    //! @param ids feature ids, left empty if setFeatureId() has not been called
+    void releaseModelInstances( osg::Vec3Array& positions, osg::Vec2Array& scaleRotations, osg::UIntArray& ids );
+
+    //! adds the surfaces of footprint extruded from base to base + height: walls along
+    //! the ring edges, facing outward, and the footprint as a roof
+    //! @note the z of the footprint is ignored, there is no floor
+    void extrude( WKB footprint, float base, float height );
+    void extrude( BinaryWKB footprint, float base, float height );
+
+    //! hands the vertex ranges [first, last) of each footprint extruded and each bar added
+    //! by addBar, none are left in the mesh; draped on the terrain, all the vertices of a
+    //! range are raised by the same ground height to keep roofs flat on slopes
+    void releaseExtrusions( std::vector< std::pair< unsigned, unsigned > >& ranges );
+
+    //! segments of the linestrings added by push_back, not part of the triangle geometry
+    size_t numLineSegments() const {
+        return _lineIdx.size() / 2;
+    }
+
+    //! hands the line buffers to a new GL_LINES geometry without copy, none are left
+    //! in the mesh, see Ribbons.h to draw them wider than hardware lines
+    osg::Geometry* releaseLines();
+
+    //! add the triangles (lines and instances) of other after ours, indices are offset accordingly
+    void append( const Mesh& other );
+
+    //! vertices and indices added by addBar
+    static const size_t BAR_VERTICES = 20;
+    static const size_t BAR_INDICES = 90;
 
+    //! adds the room needed by geometry to numVertices and numIndices, from the point and
+    //! ring counts of the WKB headers, coordinates are not decoded
+    //! @param extruded includes the walls added by extrude()
+    static void estimate( WKB geometry, size_t& numVertices, size_t& numIndices, bool extruded = false );
+    static void estimate( BinaryWKB geometry, size_t& numVertices, size_t& numIndices, bool extruded = false );
+
+    //! reserves room for numVertices and numIndices more, the capacity still grows
+    //! geometrically if called batch after batch
+    void reserve( size_t numVertices, size_t numIndices );
+
+    size_t numVertices() const {
+        return _vtx.size();
+    }
+
+    size_t numIndices() const {
+        return _tri.size();
+    }
+
+    //! polygons that could not be triangulated, they are missing from the mesh
+    size_t numDroppedPolygons() const {
+        return _numDroppedPolygons;
+    }
+
+    //! copies the mesh in a new geometry
     osg::Geometry* createGeometry() const;
 
+    //! hands the buffers to a new geometry without copy, the mesh is left empty
+    osg::Geometry* releaseGeometry();
+
+    //! triangle corners per vertex: vertices of a polygon are shared by its triangles,
+    //! this is 1 without welding
+    //!
+    //! welding is done per polygon, a vertex is never shared by two polygons, be they
+    //! faces of the same feature (walls and roof of an extrusion) or of the same tile
+    float vertexReduction() const {
+        return _vtx.empty() ? 1 : float( _tri.size() ) / _vtx.size();
+    }
+
 private:
     std::vector<osg::Vec3> _vtx;
     std::vector<osg::Vec3> _nrml;
     std::vector<unsigned> _tri;
+
+    //! per vertex value of a feature property, stored up to the vertices added before
+    //! the last set(), the following ones get the current value
+    struct FeatureAttribute {
+        FeatureAttribute()
+            : _current( 0 )
+            , _used( false )
+        {}
+
+        void set( unsigned value, size_t numVertices );
+        void append( const FeatureAttribute& other, size_t numVertices, size_t otherNumVertices );
+        void reserve( size_t capacity );
+        //! adds the array, with numVertices values, to geom if set() has been called
+        void addTo( osg::Geometry& geom, unsigned attribute, size_t numVertices ) const;
+        //! same without copy, values are left empty
+        void releaseTo( osg::Geometry& geom, unsigned attribute, size_t numVertices );
+        //! same for instance arrays, left empty if set() has not been called
+        void releaseTo( osg::UIntArray& values, size_t numVertices );
+
+    private:
+        std::vector<unsigned> _values;
+        unsigned _current;
+        bool _used;
+    };
+
+    FeatureAttribute _fid;
+    FeatureAttribute _class;
+    FeatureAttribute _lineFid;
+    FeatureAttribute _barFid;
+    FeatureAttribute _modelFid;
+    std::vector<osg::Vec3> _lineVtx;
+    std::vector<unsigned> _lineIdx;
+    std::vector<osg::Vec3> _barPos;
+    std::vector<osg::Vec2> _barSize;
+    std::vector<osg::Vec3> _modelPos;
+    std::vector<osg::Vec2> _modelScaleRotation;
+    std::vector< std::pair< unsigned, unsigned > > _extrusions;
     const osg::Matrixd _layerToWord;
+    const bool _withNormals;
+    const double _arcTolerance;
+
+    //! rings of the polygon being added, in world coordinates, the closing point is kept
+    //! @note members to keep allocated memory from one polygon to the next
+    std::vector<osg::Vec3d> _ringVtx;
+    std::vector<unsigned> _ringSize;
+    bool _hasZ;
+
+    //! the footprint being added is extruded, see extrude()
+    bool _extruding;
+    float _base;
+    float _height;
+
+    Triangulator _triangulator;
+    size_t _numDroppedPolygons;
+
+    //! mesh vertex of each ring vertex, NO_VERTEX if not used yet by the polygon being added
+    std::vector<unsigned> _ringToMesh;
+    unsigned meshVertex( size_t ringVertex );
+
+    //! vertices created by glu tessellation at intersections, glu keeps pointers to them
+    std::list<osg::Vec3d> _combinedVtx;
+
+    // polygon construction, WkbReader and liblwgeom conversion feed those
+    void beginPolygon( bool hasZ );
+    void beginRing( unsigned numPoints );
+    void vertex( const osg::Vec3d& layerPoint );
+    void endPolygon();
+    void endTriangle();
+    void endLine();
+    //! triangulates the polygon, specialised for 2D polygons
+    template< bool HAS_Z >
+    void tessellate();
+    //! fallback for polygons the triangulator rejects, needs glu
+    void gluTessellate();
+    void extrudePolygon();
+    template< typename INPUT >
+    void extrude( INPUT& input, float base, float height );
+
+    void addBar( const osg::Vec3d& center, float width, float depth, float height );
 
     template< typename GEOM >
     void push_back( const GEOM* );  // utility fonction, specialised for several types
 
-    //! @note this is needed for glu tesselation to avoid exposing vtx and tri members
+    template< typename INPUT > friend struct WkbReader;
+
+    //! @note this is needed for the glu fallback tesselation to avoid exposing vtx and tri members
     friend void CALLBACK tessVertexCB( const GLdouble* vtx, void* data );
+    friend void CALLBACK tessCombineCB( GLdouble coords[3], GLdouble* vertexData[4], GLfloat weight[4], void** outData, void* data );
 
 };
 
@@ -0,0 +1,149 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "SFosg.h"
+#include "TestGeometry.h"
+
+#include <OpenThreads/Thread>
+
+extern "C" {
+#include <liblwgeom.h>
+}
+
+#include <iostream>
+#include <cstdlib>
+
+//! raw EWKB of a WKT, as the postgis plugin receives it, empty if liblwgeom rejects it
+//! @note converted before the threads start, the WKT parser of liblwgeom is not reentrant
+inline
+const std::string binaryWkb( const std::string& wkt )
+{
+    LWGEOM* lwgeom = lwgeom_from_wkt( wkt.c_str(), LW_PARSER_CHECK_NONE );
+
+    if ( !lwgeom ) {
+        return std::string();
+    }
+
+    size_t size;
+    uint8_t* wkb = lwgeom_to_wkb( lwgeom, WKB_EXTENDED, &size );
+    lwgeom_free( lwgeom );
+    const std::string result( reinterpret_cast< const char* >( wkb ), size );
+    free( wkb );
+    return result;
+}
+
+//! vertices followed by indices, to compare meshes
+inline
+const std::vector< float > content( const std::string& wkb )
+{
+    osgGIS::Mesh mesh( osg::Matrix::identity() );
+
+    try {
+        mesh.push_back( osgGIS::BinaryWKB( wkb.data(), wkb.size() ) );
+    }
+    catch ( std::exception& ) {
+        // invalid geometries are checked by SFosg_test, we only want the same result
+    }
+
+    osg::ref_ptr<osg::Geometry> geom = mesh.createGeometry();
+    std::vector< float > c;
+    const osg::Vec3Array* vtx = dynamic_cast< const osg::Vec3Array* >( geom->getVertexArray() );
+
+    for ( osg::Vec3Array::const_iterator v = vtx->begin(); v != vtx->end(); v++ ) {
+        c.push_back( v->x() );
+        c.push_back( v->y() );
+        c.push_back( v->z() );
+    }
+
+    for ( unsigned p = 0; p < geom->getNumPrimitiveSets(); p++ ) {
+        const osg::PrimitiveSet* prim = geom->getPrimitiveSet( p );
+
+        for ( unsigned i = 0; i < prim->getNumIndices(); i++ ) {
+            c.push_back( prim->index( i ) );
+        }
+    }
+
+    return c;
+}
+
+//! builds all test geometries several times and compares with the reference
+struct MeshingThread : OpenThreads::Thread {
+    MeshingThread( const std::vector< std::string >& wkb, const std::vector< std::vector< float > >& reference )
+        : _wkb( wkb )
+        , _reference( reference )
+        , _numFailures( 0 )
+    {}
+
+    void run() {
+        for ( int repeat = 0; repeat < 20; repeat++ ) {
+            for ( size_t t=0; t<_wkb.size(); t++ ) {
+                if ( content( _wkb[t] ) != _reference[t] ) {
+                    _numFailures++;
+                }
+            }
+        }
+    }
+
+    int numFailures() const {
+        return _numFailures;
+    }
+
+private:
+    const std::vector< std::string >& _wkb;
+    const std::vector< std::vector< float > >& _reference;
+    int _numFailures;
+};
+
+int main()
+{
+    const std::vector< TestGeometry > testGeometry( createTestGeometries() );
+
+    std::vector< std::string > wkb;
+    std::vector< std::vector< float > > reference;
+
+    for ( size_t t=0; t<testGeometry.size(); t++ ) {
+        const std::string w = binaryWkb( testGeometry[t].wkt );
+
+        if ( !w.empty() ) {
+            wkb.push_back( w );
+            reference.push_back( content( w ) );
+        }
+    }
+
+    std::vector< MeshingThread* > threads;
+
+    for ( int i = 0; i < 16; i++ ) {
+        threads.push_back( new MeshingThread( wkb, reference ) );
+        threads.back()->startThread();
+    }
+
+    int numFailures = 0;
+
+    for ( size_t i = 0; i < threads.size(); i++ ) {
+        threads[i]->join();
+        numFailures += threads[i]->numFailures();
+        delete threads[i];
+    }
+
+    if ( numFailures ) {
+        std::cerr << numFailures << " meshes built concurrently differ from the reference\n";
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
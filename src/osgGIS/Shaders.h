@@ -0,0 +1,223 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STACK3D_OSGGIS_SHADERS
+#define STACK3D_OSGGIS_SHADERS
+
+//! GLSL sources shared by the plugins and the viewer
+
+namespace osgGIS {
+
+//! @brief generic vertex attribute holding the feature id of mesh and line vertices,
+//!        see Mesh::setFeatureId()
+const unsigned FEATURE_ID_ATTRIBUTE = 13;
+
+//! @brief generic vertex attribute holding the feature id of bar and model instances,
+//!        with a divisor of 1, distinct from FEATURE_ID_ATTRIBUTE since divisors set by
+//!        a stateset are not reset for the per vertex geometries drawn next
+const unsigned INSTANCE_ID_ATTRIBUTE = 15;
+
+//! @brief texture unit of the visibility bitset of filtered layers
+const unsigned VISIBILITY_TEXTURE_UNIT = 1;
+
+//! @brief vertex shader object defining bool featureVisible( float id ), false if the
+//!        bool uniform filtered is set and the bit of id is not in the usamplerBuffer
+//!        visibility, bit i%32 of texel i/32 for feature i
+//!
+//! id is read from a float attribute bound to FEATURE_ID_ATTRIBUTE or INSTANCE_ID_ATTRIBUTE,
+//! hence exact below 2^24; vertex shaders move the vertices of hidden features out of the
+//! clip volume, their triangles vanish
+//!
+//! without GL_EXT_gpu_shader4 all features are visible; statesets of the programs linking
+//! this object set the visibility uniform to VISIBILITY_TEXTURE_UNIT, a sampler left on
+//! unit 0 would clash with the sampler2D of textured models
+const char* const FEATURE_FILTER_VERTEX_SOURCE = {
+    "#version 120\n"
+    "#extension GL_EXT_gpu_shader4 : enable\n"
+    "\n"
+    "#ifdef GL_EXT_gpu_shader4\n"
+    "uniform bool filtered;\n"
+    "uniform usamplerBuffer visibility;\n"
+    "\n"
+    "bool featureVisible( float featureId )\n"
+    "{\n"
+    "    if ( !filtered ) {\n"
+    "        return true;\n"
+    "    }\n"
+    "    int id = int( featureId );\n"
+    "    if ( id / 32 >= textureSizeBuffer( visibility ) ) {\n"
+    "        return false;\n"
+    "    }\n"
+    "    unsigned int word = texelFetchBuffer( visibility, id / 32 ).r;\n"
+    "    return ( ( word >> unsigned int( id % 32 ) ) & 1u ) != 0u;\n"
+    "}\n"
+    "#else\n"
+    "bool featureVisible( float featureId )\n"
+    "{\n"
+    "    return true;\n"
+    "}\n"
+    "#endif\n"
+};
+
+//! @brief generic vertex attribute holding the class index of mesh vertices, see
+//!        Mesh::setFeatureClass()
+const unsigned CLASS_ATTRIBUTE = 14;
+
+//! @brief size of the palette uniform array of classified layers
+const unsigned MAX_CLASSES = 64;
+
+//! @brief vertex shader object defining vec4 classColor(), the entry of the vec4
+//!        palette[MAX_CLASSES] uniform for the featureClass attribute, clamped
+//!
+//! featureClass is to be bound to CLASS_ATTRIBUTE, the bool uniform classified tells
+//! fragment shaders to light with this color instead of the material
+const char* const CLASS_COLOR_VERTEX_SOURCE = {
+    "#version 120\n"
+    "attribute float featureClass;\n"
+    "uniform vec4 palette[64];\n"
+    "\n"
+    "vec4 classColor()\n"
+    "{\n"
+    "    return palette[ int( clamp( featureClass, 0.0, 63.0 ) ) ];\n"
+    "}\n"
+};
+
+//! @brief fragment shader object defining vec4 lighting( vec3 n, vec3 position ),
+//!        what the fixed pipeline does with the first light and the front material
+//!
+//! n is the unit eye space normal and position the eye space position of the fragment
+//!
+//! the overload vec4 lighting( vec3 n, vec3 position, vec4 color ) lights a classified
+//! fragment, color replaces the ambient and diffuse material as with glColorMaterial
+const char* const LIGHTING_FRAGMENT_SOURCE = {
+    "#version 120\n"
+    "\n"
+    "vec4 lighting( vec3 n, vec3 position )\n"
+    "{\n"
+    "    vec3 l = normalize( gl_LightSource[0].position.xyz - position * gl_LightSource[0].position.w );\n"
+    "    float diffuse = max( dot( n, l ), 0.0 );\n"
+    "    vec4 color = gl_FrontLightModelProduct.sceneColor + gl_FrontLightProduct[0].ambient\n"
+    "               + diffuse * gl_FrontLightProduct[0].diffuse;\n"
+    "    if ( diffuse > 0.0 ) {\n"
+    "        vec3 h = normalize( l - normalize( position ) );\n"
+    "        color += pow( max( dot( n, h ), 0.0 ), gl_FrontMaterial.shininess ) * gl_FrontLightProduct[0].specular;\n"
+    "    }\n"
+    "    return vec4( color.rgb, gl_FrontMaterial.diffuse.a );\n"
+    "}\n"
+    "\n"
+    "vec4 lighting( vec3 n, vec3 position, vec4 material )\n"
+    "{\n"
+    "    vec3 l = normalize( gl_LightSource[0].position.xyz - position * gl_LightSource[0].position.w );\n"
+    "    float diffuse = max( dot( n, l ), 0.0 );\n"
+    "    vec4 color = gl_FrontLightModelProduct.sceneColor\n"
+    "               + ( gl_LightSource[0].ambient + diffuse * gl_LightSource[0].diffuse ) * material;\n"
+    "    if ( diffuse > 0.0 ) {\n"
+    "        vec3 h = normalize( l - normalize( position ) );\n"
+    "        color += pow( max( dot( n, h ), 0.0 ), gl_FrontMaterial.shininess ) * gl_FrontLightProduct[0].specular;\n"
+    "    }\n"
+    "    return vec4( color.rgb, material.a );\n"
+    "}\n"
+};
+
+//! @brief vertex shader of smooth shaded classified layers, geometries have a normal
+//!        array, the fixed pipeline lights the others
+//!
+//! to be linked with CLASS_COLOR_VERTEX_SOURCE and FEATURE_FILTER_VERTEX_SOURCE
+const char* const SMOOTH_VERTEX_SOURCE = {
+    "#version 120\n"
+    "varying vec3 normal;\n"
+    "varying vec3 position;\n"
+    "varying vec4 color;\n"
+    "\n"
+    "attribute float featureId;\n"
+    "\n"
+    "vec4 classColor();\n"
+    "bool featureVisible( float id );\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    normal = normalize( gl_NormalMatrix * gl_Normal );\n"
+    "    position = vec3( gl_ModelViewMatrix * gl_Vertex );\n"
+    "    color = classColor();\n"
+    "    gl_Position = featureVisible( featureId ) ? ftransform() : vec4( 2.0, 2.0, 2.0, 1.0 );\n"
+    "}\n"
+};
+
+//! @brief fragment shader of smooth shaded layers, and of quantized ones
+//!
+//! to be linked with LIGHTING_FRAGMENT_SOURCE
+const char* const SMOOTH_FRAGMENT_SOURCE = {
+    "#version 120\n"
+    "varying vec3 normal;\n"
+    "varying vec3 position;\n"
+    "varying vec4 color;\n"
+    "uniform bool classified;\n"
+    "\n"
+    "vec4 lighting( vec3 n, vec3 position );\n"
+    "vec4 lighting( vec3 n, vec3 position, vec4 material );\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    vec3 n = normalize( normal );\n"
+    "    gl_FragColor = classified ? lighting( n, position, color ) : lighting( n, position );\n"
+    "}\n"
+};
+
+//! @brief vertex shader of flat shaded layers, geometries have no normal array
+//!
+//! to be linked with CLASS_COLOR_VERTEX_SOURCE and FEATURE_FILTER_VERTEX_SOURCE
+const char* const FLAT_VERTEX_SOURCE = {
+    "#version 120\n"
+    "varying vec3 position;\n"
+    "varying vec4 color;\n"
+    "\n"
+    "attribute float featureId;\n"
+    "\n"
+    "vec4 classColor();\n"
+    "bool featureVisible( float id );\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    position = vec3( gl_ModelViewMatrix * gl_Vertex );\n"
+    "    color = classColor();\n"
+    "    gl_Position = featureVisible( featureId ) ? ftransform() : vec4( 2.0, 2.0, 2.0, 1.0 );\n"
+    "}\n"
+};
+
+//! @brief fragment shader of flat shaded layers, the face normal is derived from
+//!        the screen space derivatives of the eye space position
+//!
+//! to be linked with LIGHTING_FRAGMENT_SOURCE
+const char* const FLAT_FRAGMENT_SOURCE = {
+    "#version 120\n"
+    "varying vec3 position;\n"
+    "varying vec4 color;\n"
+    "uniform bool classified;\n"
+    "\n"
+    "vec4 lighting( vec3 n, vec3 position );\n"
+    "vec4 lighting( vec3 n, vec3 position, vec4 material );\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    vec3 n = normalize( cross( dFdx( position ), dFdy( position ) ) );\n"
+    "    gl_FragColor = classified ? lighting( n, position, color ) : lighting( n, position );\n"
+    "}\n"
+};
+
+}
+#endif
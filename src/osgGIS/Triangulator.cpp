@@ -0,0 +1,467 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Triangulator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// The ear clipping and hole bridging follow the earcut algorithm (mapbox, ISC licence).
+// Nodes are kept in a vector and linked by index. Note that area() has the sign opposite
+// to the usual cross product: it is negative for a left turn.
+
+namespace osgGIS {
+
+namespace {
+inline
+bool pointInTriangle( double ax, double ay, double bx, double by, double cx, double cy, double px, double py )
+{
+    return ( cx - px ) * ( ay - py ) >= ( ax - px ) * ( cy - py )
+           && ( ax - px ) * ( by - py ) >= ( bx - px ) * ( ay - py )
+           && ( bx - px ) * ( cy - py ) >= ( cx - px ) * ( by - py );
+}
+
+inline
+int sign( double x )
+{
+    return ( x > 0 ) - ( x < 0 );
+}
+}
+
+int Triangulator::insert( const Node& node, int last )
+{
+    const int n = _nodes.size();
+    _nodes.push_back( node );
+
+    if ( last < 0 ) {
+        _nodes[n].prev = n;
+        _nodes[n].next = n;
+    }
+    else {
+        _nodes[n].next = _nodes[last].next;
+        _nodes[n].prev = last;
+        _nodes[ _nodes[last].next ].prev = n;
+        _nodes[last].next = n;
+    }
+
+    return n;
+}
+
+// the removed node keeps its links, they are used to continue traversals
+void Triangulator::remove( int n )
+{
+    _nodes[ _nodes[n].next ].prev = _nodes[n].prev;
+    _nodes[ _nodes[n].prev ].next = _nodes[n].next;
+}
+
+// links the points of a ring projected on the plane orthogonal to axis,
+// counterclockwise for the exterior ring and clockwise for holes
+int Triangulator::ring( const std::vector< osg::Vec3d >& vtx, unsigned begin, unsigned end, int axis, bool flip, bool exterior )
+{
+    const int u = ( axis + 1 ) % 3;
+    const int v = ( axis + 2 ) % 3;
+    const double s = flip ? -1 : 1;
+
+    double doubleArea = 0;
+
+    for ( unsigned i = begin, j = end - 1; i < end; j = i++ ) {
+        doubleArea += ( vtx[j][u] - vtx[i][u] ) * ( vtx[i][v] + vtx[j][v] );
+    }
+
+    const bool reverse = ( s * doubleArea > 0 ) != exterior;
+    int last = -1;
+
+    for ( unsigned k = begin; k < end; k++ ) {
+        const unsigned i = reverse ? end - 1 - ( k - begin ) : k;
+        const Node node = { s * vtx[i][u], vtx[i][v], i, -1, -1 };
+
+        if ( last >= 0 && _nodes[last].x == node.x && _nodes[last].y == node.y ) {
+            continue;
+        }
+
+        last = insert( node, last );
+    }
+
+    // the closing point duplicates the first
+    if ( last >= 0 && equals( last, _nodes[last].next ) ) {
+        remove( last );
+        last = _nodes[last].next;
+    }
+
+    return last;
+}
+
+// removes duplicated and collinear points
+int Triangulator::filterPoints( int start, int end )
+{
+    if ( end < 0 ) {
+        end = start;
+    }
+
+    int p = start;
+    bool again;
+
+    do {
+        again = false;
+
+        if ( equals( p, _nodes[p].next ) || area( _nodes[p].prev, p, _nodes[p].next ) == 0 ) {
+            remove( p );
+            p = end = _nodes[p].prev;
+
+            if ( p == _nodes[p].next ) {
+                break;
+            }
+
+            again = true;
+        }
+        else {
+            p = _nodes[p].next;
+        }
+    }
+    while ( again || p != end );
+
+    return end;
+}
+
+bool Triangulator::isEar( int ear ) const
+{
+    const Node& a = _nodes[ _nodes[ear].prev ];
+    const Node& b = _nodes[ear];
+    const Node& c = _nodes[ b.next ];
+
+    if ( area( b.prev, ear, b.next ) >= 0 ) {
+        return false; // reflex
+    }
+
+    // no other reflex point may be inside the ear
+    for ( int p = c.next; p != b.prev; p = _nodes[p].next ) {
+        if ( pointInTriangle( a.x, a.y, b.x, b.y, c.x, c.y, _nodes[p].x, _nodes[p].y )
+                && area( _nodes[p].prev, p, _nodes[p].next ) >= 0 ) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Triangulator::earcut( int ear )
+{
+    for ( int pass = 0; pass < 2; pass++ ) {
+        int stop = ear;
+
+        while ( _nodes[ear].prev != _nodes[ear].next ) {
+            const int prev = _nodes[ear].prev;
+            const int next = _nodes[ear].next;
+
+            if ( isEar( ear ) ) {
+                _tri.push_back( _nodes[prev].i );
+                _tri.push_back( _nodes[ear].i );
+                _tri.push_back( _nodes[next].i );
+                remove( ear );
+                ear = stop = _nodes[next].next;
+                continue;
+            }
+
+            ear = next;
+
+            if ( ear == stop ) {
+                break;
+            }
+        }
+
+        if ( _nodes[ear].prev == _nodes[ear].next ) {
+            return true;
+        }
+
+        // no ear left, try again without collinear points
+        ear = filterPoints( ear );
+    }
+
+    return false;
+}
+
+bool Triangulator::locallyInside( int a, int b ) const
+{
+    const int prev = _nodes[a].prev;
+    const int next = _nodes[a].next;
+    return area( prev, a, next ) < 0
+           ? area( a, b, next ) >= 0 && area( a, prev, b ) >= 0
+           : area( a, b, prev ) < 0 || area( a, next, b ) < 0;
+}
+
+bool Triangulator::sectorContainsSector( int m, int p ) const
+{
+    return area( _nodes[m].prev, m, _nodes[p].prev ) < 0 && area( _nodes[p].next, m, _nodes[m].next ) < 0;
+}
+
+// David Eberly's algorithm: the bridge goes from the leftmost point of the hole
+// to a visible point of the exterior ring on its left
+int Triangulator::findHoleBridge( int hole, int outer ) const
+{
+    const double hx = _nodes[hole].x;
+    const double hy = _nodes[hole].y;
+    double qx = -std::numeric_limits< double >::max();
+    int m = -1;
+    int p = outer;
+
+    // segment intersected by a ray going left from the hole, closest to the hole
+    do {
+        const Node& a = _nodes[p];
+        const Node& b = _nodes[a.next];
+
+        if ( hy <= a.y && hy >= b.y && b.y != a.y ) {
+            const double x = a.x + ( hy - a.y ) * ( b.x - a.x ) / ( b.y - a.y );
+
+            if ( x <= hx && x > qx ) {
+                qx = x;
+
+                if ( x == hx ) {
+                    if ( hy == a.y ) {
+                        return p;
+                    }
+
+                    if ( hy == b.y ) {
+                        return a.next;
+                    }
+                }
+
+                m = a.x < b.x ? p : a.next;
+            }
+        }
+
+        p = a.next;
+    }
+    while ( p != outer );
+
+    if ( m < 0 || hx == qx ) {
+        return m;
+    }
+
+    // look for points inside the triangle hole point, segment intersection and
+    // endpoint; if there are no points found, we have a valid connection,
+    // otherwise choose the point of the minimum angle with the ray as connection point
+    const int stop = m;
+    const double mx = _nodes[m].x;
+    const double my = _nodes[m].y;
+    double tanMin = std::numeric_limits< double >::max();
+    p = m;
+
+    do {
+        const Node& n = _nodes[p];
+
+        if ( hx >= n.x && n.x >= mx && hx != n.x
+                && pointInTriangle( hy < my ? hx : qx, hy, mx, my, hy < my ? qx : hx, hy, n.x, n.y ) ) {
+            const double tan = std::abs( hy - n.y ) / ( hx - n.x );
+
+            if ( locallyInside( p, hole )
+                    && ( tan < tanMin
+                         || ( tan == tanMin && ( n.x > _nodes[m].x || ( n.x == _nodes[m].x && sectorContainsSector( m, p ) ) ) ) ) ) {
+                m = p;
+                tanMin = tan;
+            }
+        }
+
+        p = n.next;
+    }
+    while ( p != stop );
+
+    return m;
+}
+
+// links a to b with a bridge, the polygon is split in two if a and b belong to the same
+// ring, returns the copy of b
+int Triangulator::split( int a, int b )
+{
+    const int a2 = _nodes.size();
+    _nodes.push_back( _nodes[a] );
+    const int b2 = _nodes.size();
+    _nodes.push_back( _nodes[b] );
+    const int an = _nodes[a].next;
+    const int bp = _nodes[b].prev;
+
+    _nodes[a].next = b;
+    _nodes[b].prev = a;
+
+    _nodes[a2].next = an;
+    _nodes[an].prev = a2;
+
+    _nodes[b2].next = a2;
+    _nodes[a2].prev = b2;
+
+    _nodes[bp].next = b2;
+    _nodes[b2].prev = bp;
+
+    return b2;
+}
+
+int Triangulator::eliminateHole( int hole, int outer )
+{
+    const int bridge = findHoleBridge( hole, outer );
+
+    if ( bridge < 0 ) {
+        return -1;
+    }
+
+    const int bridgeReverse = split( bridge, hole );
+    const int filteredBridge = filterPoints( bridge, _nodes[bridge].next );
+    filterPoints( bridgeReverse, _nodes[bridgeReverse].next );
+
+    return outer == bridge ? filteredBridge : outer;
+}
+
+// strictly convex and simple: all turns to the left and the direction along x
+// changes sign twice only, a star has all turns to the left too
+bool Triangulator::isConvex( int start ) const
+{
+    int changes = 0;
+    int previousSign = 0;
+    int p = start;
+
+    do {
+        const int next = _nodes[p].next;
+
+        if ( area( _nodes[p].prev, p, next ) >= 0 ) {
+            return false;
+        }
+
+        const int s = sign( _nodes[next].x - _nodes[p].x );
+
+        if ( s ) {
+            changes += previousSign && s != previousSign;
+            previousSign = s;
+        }
+
+        p = next;
+    }
+    while ( p != start );
+
+    return changes <= 2;
+}
+
+bool Triangulator::operator()( const std::vector< osg::Vec3d >& vtx, const std::vector< unsigned >& ringSize, std::vector< unsigned >& triangles )
+{
+    if ( ringSize.empty() || ringSize[0] < 4 ) {
+        return false;
+    }
+
+    // Newell's normal of the exterior ring gives the projection plane and orientation
+    osg::Vec3d normal;
+
+    for ( unsigned i = 0; i + 1 < ringSize[0]; i++ ) {
+        const osg::Vec3d& a = vtx[i];
+        const osg::Vec3d& b = vtx[i + 1];
+        normal.x() += ( a.y() - b.y() ) * ( a.z() + b.z() );
+        normal.y() += ( a.z() - b.z() ) * ( a.x() + b.x() );
+        normal.z() += ( a.x() - b.x() ) * ( a.y() + b.y() );
+    }
+
+    int axis = 0;
+
+    for ( int i = 1; i < 3; i++ ) {
+        if ( std::abs( normal[i] ) > std::abs( normal[axis] ) ) {
+            axis = i;
+        }
+    }
+
+    if ( normal[axis] == 0 ) {
+        return false;
+    }
+
+    return triangulate( vtx, ringSize, axis, normal[axis] < 0, triangles );
+}
+
+bool Triangulator::horizontal( const std::vector< osg::Vec3d >& vtx, const std::vector< unsigned >& ringSize, std::vector< unsigned >& triangles )
+{
+    if ( ringSize.empty() || ringSize[0] < 4 ) {
+        return false;
+    }
+
+    return triangulate( vtx, ringSize, 2, false, triangles );
+}
+
+bool Triangulator::triangulate( const std::vector< osg::Vec3d >& vtx, const std::vector< unsigned >& ringSize, int axis, bool flip, std::vector< unsigned >& triangles )
+{
+    _nodes.clear();
+    _holes.clear();
+    _tri.clear();
+
+    int outer = ring( vtx, 0, ringSize[0], axis, flip, true );
+
+    if ( outer < 0 || _nodes[outer].next == _nodes[outer].prev ) {
+        return false;
+    }
+
+    if ( ringSize.size() == 1 && isConvex( outer ) ) {
+        for ( int p = _nodes[outer].next; _nodes[p].next != outer; p = _nodes[p].next ) {
+            _tri.push_back( _nodes[outer].i );
+            _tri.push_back( _nodes[p].i );
+            _tri.push_back( _nodes[ _nodes[p].next ].i );
+        }
+    }
+    else {
+        unsigned begin = ringSize[0];
+
+        for ( size_t r = 1; r < ringSize.size(); r++ ) {
+            const int hole = ring( vtx, begin, begin + ringSize[r], axis, flip, false );
+            begin += ringSize[r];
+
+            if ( hole < 0 || _nodes[hole].next == _nodes[hole].prev ) {
+                continue; // degenerated hole, nothing to cut
+            }
+
+            // leftmost point
+            int leftmost = hole;
+
+            for ( int p = _nodes[hole].next; p != hole; p = _nodes[p].next ) {
+                if ( _nodes[p].x < _nodes[leftmost].x
+                        || ( _nodes[p].x == _nodes[leftmost].x && _nodes[p].y < _nodes[leftmost].y ) ) {
+                    leftmost = p;
+                }
+            }
+
+            _holes.push_back( leftmost );
+        }
+
+        // holes are bridged from left to right
+        for ( size_t i = 1; i < _holes.size(); i++ ) {
+            for ( size_t j = i; j > 0 && _nodes[ _holes[j] ].x < _nodes[ _holes[j - 1] ].x; j-- ) {
+                std::swap( _holes[j], _holes[j - 1] );
+            }
+        }
+
+        // as in mapbox earcut, a hole that cannot be bridged is left out rather than
+        // losing the whole polygon
+        for ( size_t h = 0; h < _holes.size(); h++ ) {
+            const int bridged = eliminateHole( _holes[h], outer );
+
+            if ( bridged >= 0 ) {
+                outer = bridged;
+            }
+        }
+
+        if ( !earcut( outer ) ) {
+            return false;
+        }
+    }
+
+    triangles.insert( triangles.end(), _tri.begin(), _tri.end() );
+    return true;
+}
+
+}
@@ -0,0 +1,91 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STACK3D_OSGGIS_TRIANGULATOR
+#define STACK3D_OSGGIS_TRIANGULATOR
+
+#include <osg/Vec3d>
+
+#include <vector>
+
+namespace osgGIS {
+
+//! @brief triangulation of planar polygons with holes, without GLU
+//!
+//! The rings are projected on the main plane of the exterior ring. Convex polygons
+//! without holes (walls are quads) are triangulated as a fan, other polygons by ear
+//! clipping, the holes being first bridged to the exterior ring. A hole that cannot be
+//! bridged is skipped.
+//!
+//! Triangles have the orientation of the exterior ring.
+//!
+//! @note the object keeps its buffers from one polygon to the next
+struct Triangulator {
+    //! @param vtx vertices of all rings, each one closed (last point duplicates the first)
+    //! @param ringSize number of points of each ring, exterior ring first
+    //! @param triangles indices in vtx, 3 per triangle, appended
+    //! @return false if the polygon is degenerate, triangles are then left unchanged
+    bool operator()( const std::vector< osg::Vec3d >& vtx, const std::vector< unsigned >& ringSize, std::vector< unsigned >& triangles );
+
+    //! same for polygons known to be horizontal, triangulated in XY without computing
+    //! their normal, triangles are counterclockwise seen from above whatever the
+    //! orientation of the rings
+    bool horizontal( const std::vector< osg::Vec3d >& vtx, const std::vector< unsigned >& ringSize, std::vector< unsigned >& triangles );
+
+private:
+    struct Node {
+        double x;
+        double y;
+        unsigned i; // index in the input
+        int prev;
+        int next;
+    };
+
+    std::vector< Node > _nodes;
+    std::vector< int > _holes;
+    std::vector< unsigned > _tri;
+
+    //! triangulation projected on the plane orthogonal to axis, reversed if flip
+    bool triangulate( const std::vector< osg::Vec3d >& vtx, const std::vector< unsigned >& ringSize, int axis, bool flip, std::vector< unsigned >& triangles );
+    int ring( const std::vector< osg::Vec3d >& vtx, unsigned begin, unsigned end, int axis, bool flip, bool exterior );
+    int insert( const Node& node, int last );
+    void remove( int n );
+    int filterPoints( int start, int end = -1 );
+    bool earcut( int ear );
+    bool isEar( int ear ) const;
+    int eliminateHole( int hole, int outer );
+    int findHoleBridge( int hole, int outer ) const;
+    bool locallyInside( int a, int b ) const;
+    bool sectorContainsSector( int m, int p ) const;
+    int split( int a, int b );
+    bool isConvex( int start ) const;
+
+    double area( int p, int q, int r ) const {
+        const Node& a = _nodes[p];
+        const Node& b = _nodes[q];
+        const Node& c = _nodes[r];
+        return ( b.y - a.y ) * ( c.x - b.x ) - ( b.x - a.x ) * ( c.y - b.y );
+    }
+
+    bool equals( int p, int q ) const {
+        return _nodes[p].x == _nodes[q].x && _nodes[p].y == _nodes[q].y;
+    }
+};
+
+}
+#endif
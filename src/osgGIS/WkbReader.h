@@ -0,0 +1,539 @@
+/**
+ *   Horao
+ *
+ *   Copyright (C) 2013 Oslandia <infos@oslandia.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+
+ *   You should have received a copy of the GNU Library General Public
+ *   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STACK3D_OSGGIS_WKBREADER
+#define STACK3D_OSGGIS_WKBREADER
+
+#include <osg/Vec3d>
+
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+#include <cmath>
+
+namespace osgGIS {
+
+//! @brief byte source for raw (binary) EWKB
+struct BinaryInput {
+    BinaryInput( const char* data, size_t size )
+        : _data( reinterpret_cast< const unsigned char* >( data ) )
+        , _end( _data + size )
+    {}
+
+    void read( unsigned char* dest, size_t n ) {
+        if ( _data + n > _end ) {
+            throw std::runtime_error( "truncated WKB" );
+        }
+
+        std::memcpy( dest, _data, n );
+        _data += n;
+    }
+
+    void skip( size_t n ) {
+        if ( _data + n > _end ) {
+            throw std::runtime_error( "truncated WKB" );
+        }
+
+        _data += n;
+    }
+
+private:
+    const unsigned char* _data;
+    const unsigned char* const _end;
+};
+
+//! @brief byte source for hex encoded EWKB, as returned by postgis in text mode
+//! @note bytes are decoded on the fly, the string is never copied,
+//!       the terminating '\0' is not an hex digit and ends up as a truncation error
+struct HexInput {
+    HexInput( const char* data )
+        : _data( data )
+    {}
+
+    void read( unsigned char* dest, size_t n ) {
+        for ( size_t i = 0; i < n; i++, _data += 2 ) {
+            // the high nibble is decoded first, it throws on the terminating '\0'
+            // before the byte after it is read
+            const unsigned char high = nibble( _data[0] );
+            dest[i] = ( high << 4 ) | nibble( _data[1] );
+        }
+    }
+
+    //! the string is still checked for its end, but not decoded
+    void skip( size_t n ) {
+        for ( size_t i = 0; i < 2*n; i++, _data++ ) {
+            if ( !*_data ) {
+                throw std::runtime_error( "truncated WKB" );
+            }
+        }
+    }
+
+private:
+    const char* _data;
+
+    static unsigned char nibble( char c ) {
+        if ( c >= '0' && c <= '9' ) {
+            return c - '0';
+        }
+
+        if ( c >= 'A' && c <= 'F' ) {
+            return c - 'A' + 10;
+        }
+
+        if ( c >= 'a' && c <= 'f' ) {
+            return c - 'a' + 10;
+        }
+
+        throw std::runtime_error( c ? "invalid hex digit in WKB" : "truncated WKB" );
+    }
+};
+
+//! @brief single pass (E)WKB decoder, no intermediate geometry is created
+//!
+//! Surfaces and lines are streamed to a SINK that must provide:
+//!  - beginPolygon( bool hasZ )
+//!  - beginRing( unsigned numPoints )
+//!  - vertex( const osg::Vec3d& )
+//!  - endPolygon()
+//!  - endTriangle() (a triangle is sent as a polygon with one ring)
+//!  - endLine() (a linestring is sent as a polygon with one ring)
+//!
+//! Curves are linearized: arcs are split in as many segments as needed to stay
+//! within arcTolerance of the circle, and at least MIN_ARC_SEGMENTS, at most
+//! MAX_ARC_SEGMENTS per full turn.
+//!
+//! Both ISO (type + 1000*dim) and postgis extended (flags in high bits, optional srid)
+//! flavours are accepted, in either byte order.
+template< typename INPUT >
+struct WkbReader {
+    // wkb type codes
+    enum Type {
+        POINT = 1,
+        LINESTRING = 2,
+        POLYGON = 3,
+        MULTIPOINT = 4,
+        MULTILINESTRING = 5,
+        MULTIPOLYGON = 6,
+        GEOMETRYCOLLECTION = 7,
+        CIRCULARSTRING = 8,
+        COMPOUNDCURVE = 9,
+        CURVEPOLYGON = 10,
+        MULTICURVE = 11,
+        MULTISURFACE = 12,
+        POLYHEDRALSURFACE = 15,
+        TIN = 16,
+        TRIANGLE = 17
+    };
+
+    //! segment budget of a full turn, whatever the tolerance
+    static const unsigned MIN_ARC_SEGMENTS = 8;
+    static const unsigned MAX_ARC_SEGMENTS = 128;
+
+    //! @param arcTolerance maximum distance between an arc and its segments, in
+    //!        layer units, 0 for the finest tessellation
+    WkbReader( INPUT& input, double arcTolerance = 0 )
+        : _input( input )
+        , _swap( false )
+        , _hasZ( false )
+        , _hasM( false )
+        , _arcTolerance( arcTolerance )
+    {}
+
+    //! stream the surfaces and lines of the geometry to the sink
+    template< typename SINK >
+    void read( SINK& sink ) {
+        const unsigned type = header();
+
+        switch ( type ) {
+        case POLYGON:
+            polygon( sink );
+            break;
+        case TRIANGLE:
+            polygon( sink, true );
+            break;
+        case LINESTRING:
+            line( sink );
+            break;
+        case CIRCULARSTRING:
+        case COMPOUNDCURVE: {
+            const bool hasZ = _hasZ;
+            _curve.clear();
+            curve( type, _curve );
+
+            if ( !_curve.empty() ) {
+                sink.beginPolygon( hasZ );
+                curveRing( sink );
+                sink.endLine();
+            }
+        }
+        break;
+        case CURVEPOLYGON:
+            curvePolygon( sink );
+            break;
+        case MULTILINESTRING:
+        case MULTICURVE:
+        case MULTISURFACE:
+        case MULTIPOLYGON:
+        case GEOMETRYCOLLECTION:
+        case POLYHEDRALSURFACE:
+        case TIN: {
+            const unsigned numGeom = value< unsigned >();
+
+            for ( unsigned g = 0; g < numGeom; g++ ) {
+                read( sink );
+            }
+        }
+        break;
+        case POINT:
+            throw std::runtime_error( "POINTTYPE not handled" );
+        case MULTIPOINT:
+            throw std::runtime_error( "MULTIPOINTTYPE not handled" );
+        default:
+            throw std::runtime_error( "unknown WKB geometry type" );
+        }
+    }
+
+    //! adds up the points and rings of the surfaces, coordinates are skipped
+    //! @return false if the geometry contains types that read() does not handle
+    bool count( size_t& numPoints, size_t& numRings ) {
+        switch ( header() ) {
+        case POLYGON:
+        case TRIANGLE: {
+            const unsigned n = value< unsigned >();
+            const size_t pointSize = sizeof( double ) * ( 2 + _hasZ + _hasM );
+
+            for ( unsigned r = 0; r < n; r++ ) {
+                const unsigned ringPoints = value< unsigned >();
+                _input.skip( ringPoints * pointSize );
+                numPoints += ringPoints;
+            }
+
+            numRings += n;
+        }
+
+        return true;
+        case MULTIPOLYGON:
+        case GEOMETRYCOLLECTION:
+        case POLYHEDRALSURFACE:
+        case TIN: {
+            const unsigned numGeom = value< unsigned >();
+
+            for ( unsigned g = 0; g < numGeom; g++ ) {
+                if ( !count( numPoints, numRings ) ) {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+        default:
+            return false;
+        }
+    }
+
+    //! stream the points of a POINT, a MULTIPOINT or a collection of those to sink.point()
+    template< typename SINK >
+    void points( SINK& sink ) {
+        switch ( header() ) {
+        case POINT:
+            sink.point( coordinates() );
+            break;
+        case MULTIPOINT:
+        case GEOMETRYCOLLECTION: {
+            const unsigned numGeom = value< unsigned >();
+
+            for ( unsigned g = 0; g < numGeom; g++ ) {
+                points( sink );
+            }
+        }
+        break;
+        default:
+            throw std::runtime_error( "failed to get points from WKB" );
+        }
+    }
+
+    //! read a geometry that must be a point
+    const osg::Vec3d point() {
+        if ( header() != POINT ) {
+            throw std::runtime_error( "failed to get points from WKB" );
+        }
+
+        return coordinates();
+    }
+
+private:
+    INPUT& _input;
+    bool _swap;
+    bool _hasZ;
+    bool _hasM;
+
+    static bool isLittleEndian() {
+        const unsigned one = 1;
+        return *reinterpret_cast< const unsigned char* >( &one );
+    }
+
+    template< typename T >
+    T value() {
+        unsigned char bytes[ sizeof( T ) ];
+        _input.read( bytes, sizeof( T ) );
+
+        if ( _swap ) {
+            for ( size_t i = 0; i < sizeof( T )/2; i++ ) {
+                std::swap( bytes[i], bytes[ sizeof( T ) - 1 - i ] );
+            }
+        }
+
+        T v;
+        std::memcpy( &v, bytes, sizeof( T ) );
+        return v;
+    }
+
+    //! reads byte order, type, dimension flags and skips the srid
+    //! @return the type without dimension
+    unsigned header() {
+        unsigned char byteOrder;
+        _input.read( &byteOrder, 1 );
+        _swap = ( byteOrder == 1 ) != isLittleEndian();
+
+        const unsigned type = value< unsigned >();
+        const unsigned iso = ( type & 0x0fffffff ) / 1000;
+        _hasZ = ( type & 0x80000000 ) || iso == 1 || iso == 3;
+        _hasM = ( type & 0x40000000 ) || iso == 2 || iso == 3;
+
+        if ( type & 0x20000000 ) {
+            value< unsigned >(); // srid
+        }
+
+        return ( type & 0x0fffffff ) % 1000;
+    }
+
+    const osg::Vec3d coordinates() {
+        const double x = value< double >();
+        const double y = value< double >();
+        const double z = _hasZ ? value< double >() : 0;
+
+        if ( _hasM ) {
+            value< double >();
+        }
+
+        return osg::Vec3d( x, y, z );
+    }
+
+    template< typename SINK >
+    void polygon( SINK& sink, bool isTriangle = false ) {
+        const unsigned numRings = value< unsigned >();
+
+        if ( !numRings ) {
+            return;    // empty
+        }
+
+        sink.beginPolygon( _hasZ );
+
+        for ( unsigned r = 0; r < numRings; r++ ) {
+            const unsigned numPoints = value< unsigned >();
+            sink.beginRing( numPoints );
+
+            for ( unsigned p = 0; p < numPoints; p++ ) {
+                sink.vertex( coordinates() );
+            }
+        }
+
+        if ( isTriangle ) {
+            sink.endTriangle();
+        }
+        else {
+            sink.endPolygon();
+        }
+    }
+
+    //! curves of the geometry being read, linearized
+    //! @note member to keep allocated memory from one geometry to the next
+    std::vector< osg::Vec3d > _curve;
+    const double _arcTolerance;
+
+    template< typename SINK >
+    void curveRing( SINK& sink ) {
+        sink.beginRing( _curve.size() );
+
+        for ( size_t p = 0; p < _curve.size(); p++ ) {
+            sink.vertex( _curve[p] );
+        }
+    }
+
+    //! rings are linestrings, circular strings or compound curves
+    template< typename SINK >
+    void curvePolygon( SINK& sink ) {
+        const bool hasZ = _hasZ;
+        const unsigned numRings = value< unsigned >();
+
+        if ( !numRings ) {
+            return;    // empty
+        }
+
+        sink.beginPolygon( hasZ );
+
+        for ( unsigned r = 0; r < numRings; r++ ) {
+            _curve.clear();
+            curve( header(), _curve );
+            curveRing( sink );
+        }
+
+        sink.endPolygon();
+    }
+
+    //! appends the points of a curve whose header has been read
+    void curve( unsigned type, std::vector< osg::Vec3d >& points ) {
+        switch ( type ) {
+        case LINESTRING: {
+            const unsigned numPoints = value< unsigned >();
+
+            for ( unsigned p = 0; p < numPoints; p++ ) {
+                points.push_back( coordinates() );
+            }
+        }
+        break;
+        case CIRCULARSTRING: {
+            const unsigned numPoints = value< unsigned >();
+
+            if ( !numPoints ) {
+                break;    // empty
+            }
+
+            if ( numPoints % 2 == 0 ) {
+                throw std::runtime_error( "circular string with an even number of points in WKB" );
+            }
+
+            osg::Vec3d start = coordinates();
+            points.push_back( start );
+
+            for ( unsigned p = 1; p < numPoints; p += 2 ) {
+                const osg::Vec3d middle = coordinates();
+                const osg::Vec3d end = coordinates();
+                arc( start, middle, end, points );
+                start = end;
+            }
+        }
+        break;
+        case COMPOUNDCURVE: {
+            const unsigned numCurves = value< unsigned >();
+
+            for ( unsigned c = 0; c < numCurves; c++ ) {
+                // each part starts where the previous one ends
+                const size_t junction = points.size();
+                curve( header(), points );
+
+                if ( junction && points.size() > junction && points[junction] == points[junction - 1] ) {
+                    points.erase( points.begin() + junction );
+                }
+            }
+        }
+        break;
+        default:
+            throw std::runtime_error( "unexpected curve type in WKB" );
+        }
+    }
+
+    //! appends the points after start of the arc through middle to end, in the xy plane,
+    //! z varies linearly along the arc from start to middle and from middle to end
+    void arc( const osg::Vec3d& start, const osg::Vec3d& middle, const osg::Vec3d& end, std::vector< osg::Vec3d >& points ) {
+        const double twoPi = 2 * 3.14159265358979323846;
+        const double ax = middle.x() - start.x();
+        const double ay = middle.y() - start.y();
+        const double bx = end.x() - start.x();
+        const double by = end.y() - start.y();
+        const double det = 2 * ( ax * by - ay * bx );
+        const bool fullTurn = start.x() == end.x() && start.y() == end.y();
+
+        // aligned points are a polyline
+        if ( !fullTurn && std::abs( det ) <= 1e-12 * ( ax * ax + ay * ay + bx * bx + by * by ) ) {
+            points.push_back( middle );
+            points.push_back( end );
+            return;
+        }
+
+        double cx, cy;
+
+        if ( fullTurn ) { // the middle point is diametrically opposed
+            cx = .5 * ( start.x() + middle.x() );
+            cy = .5 * ( start.y() + middle.y() );
+        }
+        else {
+            const double a2 = ax * ax + ay * ay;
+            const double b2 = bx * bx + by * by;
+            cx = start.x() + ( by * a2 - ay * b2 ) / det;
+            cy = start.y() + ( ax * b2 - bx * a2 ) / det;
+        }
+
+        const double radius = std::sqrt( ( start.x() - cx ) * ( start.x() - cx ) + ( start.y() - cy ) * ( start.y() - cy ) );
+        const double a0 = std::atan2( start.y() - cy, start.x() - cx );
+
+        // angles from start, counterclockwise or clockwise as the arc goes
+        const double sign = fullTurn || det > 0 ? 1 : -1;
+        double toMiddle = sign * ( std::atan2( middle.y() - cy, middle.x() - cx ) - a0 );
+        double sweep = sign * ( std::atan2( end.y() - cy, end.x() - cx ) - a0 );
+        toMiddle = toMiddle < 0 ? toMiddle + twoPi : toMiddle;
+        sweep = fullTurn ? twoPi : ( sweep < 0 ? sweep + twoPi : sweep );
+
+        // a chord of angle s is at most r(1 - cos(s/2)) from the circle
+        const double turns = sweep / twoPi;
+        double numSegments = std::ceil( turns * MAX_ARC_SEGMENTS );
+
+        if ( _arcTolerance >= radius ) {
+            numSegments = std::ceil( turns * MIN_ARC_SEGMENTS );
+        }
+        else if ( _arcTolerance > 0 ) {
+            const double step = 2 * std::acos( 1 - _arcTolerance / radius );
+            numSegments = std::max( std::ceil( turns * MIN_ARC_SEGMENTS ), std::min( numSegments, std::ceil( sweep / step ) ) );
+        }
+
+        const unsigned n = std::max( 2u, unsigned( numSegments ) );
+
+        for ( unsigned i = 1; i < n; i++ ) {
+            const double t = sweep * i / n;
+            const double z = t < toMiddle
+                             ? start.z() + ( middle.z() - start.z() ) * t / toMiddle
+                             : middle.z() + ( end.z() - middle.z() ) * ( t - toMiddle ) / ( sweep - toMiddle );
+            points.push_back( osg::Vec3d( cx + radius * std::cos( a0 + sign * t ), cy + radius * std::sin( a0 + sign * t ), z ) );
+        }
+
+        points.push_back( end );
+    }
+
+    template< typename SINK >
+    void line( SINK& sink ) {
+        const unsigned numPoints = value< unsigned >();
+
+        if ( !numPoints ) {
+            return;    // empty
+        }
+
+        sink.beginPolygon( _hasZ );
+        sink.beginRing( numPoints );
+
+        for ( unsigned p = 0; p < numPoints; p++ ) {
+            sink.vertex( coordinates() );
+        }
+
+        sink.endLine();
+    }
+};
+
+}
+#endif
@@ -19,11 +19,15 @@
 #include "Interpreter.h"
 
 #include <osgGIS/StringUtils.h>
+#include <osgGIS/Shaders.h>
 #include "SkyBox.h"
 
 #include <osgDB/ReadFile>
 #include <osgDB/FileUtils>
 #include <osg/Material>
+#include <osg/Program>
+#include <osg/Image>
+#include <osg/Texture>
 #include <osg/Geode>
 #include <osg/ShapeDrawable>
 #include <osg/PositionAttitudeTransform>
@@ -35,6 +39,9 @@
 #define POSTGIS_EXTENSION ".postgis"
 #define MNT_EXTENSION ".mnt"
 
+// angle seen by a pixel of the default view, 30 degrees over about 1000 pixels
+#define RADIANS_PER_PIXEL 5e-4
+
 namespace Stack3d {
 namespace Viewer {
 
@@ -105,6 +112,9 @@ void Interpreter::run()
         COMMAND( lookAt )
         COMMAND( addSky )
         COMMAND( writeFile )
+        COMMAND( pick )
+        COMMAND( filterFeatures )
+        COMMAND( getAttributes )
         else {
             const std::string msg = "unknown command '" + cmd + "'";
             std::cout << "<error msg=\"" << escapeXMLString( msg ) << "\"/>\n";
@@ -129,6 +139,32 @@ void Interpreter::writeFile( const AttributeMap& am )
     _viewer->writeFile( am.value( "file" ) );
 }
 
+// layers must be loaded with an id_column to be picked, and not quantized
+// since osg does not intersect short positions
+void Interpreter::pick( const AttributeMap& am )
+{
+    float x, y;
+
+    if ( !( std::stringstream( am.value( "x" ) ) >> x )
+            || !( std::stringstream( am.value( "y" ) ) >> y ) ) {
+        throw std::runtime_error( "cannot parse x or y" );
+    }
+
+    std::string layerId;
+    unsigned featureId;
+    osg::Vec3d point;
+
+    if ( !_viewer->pick( x, y, layerId, featureId, point ) ) {
+        throw std::runtime_error( "no feature at " + am.value( "x" ) + " " + am.value( "y" ) );
+    }
+
+    // a local stream, cout keeps its precision for the other commands
+    std::stringstream coordinates;
+    coordinates << std::setprecision( 12 ) << point.x() << " " << point.y() << " " << point.z();
+    std::cout << "<feature id=\"" << escapeXMLString( layerId ) << "\" fid=\"" << featureId
+              << "\" point=\"" << coordinates.str() << "\"/>\n";
+}
+
 void Interpreter::lookAt( const AttributeMap& am )
 {
     if ( am.optionalValue( "extent" ).empty() ) {
@@ -244,6 +280,35 @@ void Interpreter::addPlane( const AttributeMap& am )
     _viewer->addNode( am.value( "id" ), geode );
 }
 
+// options passed as is to the plugins, when present
+inline
+const std::string forwardedOptions( const AttributeMap& am, const char* const keys[], size_t numKeys )
+{
+    std::string options;
+
+    for ( size_t i = 0; i < numKeys; i++ ) {
+        if ( !am.optionalValue( keys[i] ).empty() ) {
+            options += std::string( keys[i] ) + "=\"" + escapeXMLString( am.optionalValue( keys[i] ) ) + "\" ";
+        }
+    }
+
+    return options;
+}
+
+inline
+const std::string postgisOptions( const AttributeMap& am )
+{
+    const char* keys[] = {"fetch_size", "prefetch", "threads", "elevation", "quantize", "shading", "instanced", "model", "line_width", "arc_tolerance", "id_column", "class_column", "attributes"};
+    return forwardedOptions( am, keys, sizeof( keys )/sizeof( char* ) );
+}
+
+inline
+const std::string mntOptions( const AttributeMap& am )
+{
+    const char* keys[] = {"quantize"};
+    return forwardedOptions( am, keys, sizeof( keys )/sizeof( char* ) );
+}
+
 void Interpreter::loadVectorPostgis( const AttributeMap& am )
 {
     std::string geocolumn = "geom";
@@ -295,6 +360,34 @@ void Interpreter::loadVectorPostgis( const AttributeMap& am )
 
         const size_t numTilesY = ( ymax-ymin )/tileSize + 1;
 
+        // the same query for all tiles, the tile envelope is a parameter
+        std::vector< std::string > queries;
+
+        for ( size_t ilod = 0; ilod < lodDistance.size()-1; ilod++ ) {
+            queries.push_back( preparedTileQuery( am.value( "query_"+intToString( ilod ) ) ) );
+        }
+
+        // curves of a level are tessellated to be off by less than arc_error pixels
+        // (1 by default) from the nearest distance it is seen at
+        double arcError = 1;
+
+        if ( !am.optionalValue( "arc_error" ).empty()
+                && !( std::stringstream( am.value( "arc_error" ) ) >> arcError ) ) {
+            throw std::runtime_error( "cannot parse arc_error" );
+        }
+
+        std::vector< std::string > arcTolerance;
+
+        for ( size_t ilod = 0; ilod < lodDistance.size()-1; ilod++ ) {
+            std::stringstream tolerance;
+
+            if ( am.optionalValue( "arc_tolerance" ).empty() ) {
+                tolerance << "arc_tolerance=\"" << lodDistance[ilod+1] * arcError * RADIANS_PER_PIXEL << "\" ";
+            }
+
+            arcTolerance.push_back( tolerance.str() );
+        }
+
         osg::ref_ptr<osg::Group> group = new osg::Group;
 
         for ( size_t ix=0; ix<numTilesX; ix++ ) {
@@ -303,14 +396,18 @@ void Interpreter::loadVectorPostgis( const AttributeMap& am )
                 const float xm = xmin + ix*tileSize;
                 const float ym = ymin + iy*tileSize;
 
+                std::stringstream tile;
+                tile << std::setprecision( 16 ) << xm << " " << ym << " " << xm+tileSize << " " << ym+tileSize;
+
                 for ( size_t ilod = 0; ilod < lodDistance.size()-1; ilod++ ) {
                     const std::string lodIdx = intToString( ilod );
-                    const std::string query = tileQuery( am.value( "query_"+lodIdx ), xm, ym, xm+tileSize, ym+tileSize );
                     const std::string pseudoFile = "conn_info=\"" + escapeXMLString( am.value( "conn_info" ) )       + "\" "
                                                    + "origin=\""    + escapeXMLString( am.value( "origin" ) )          + "\" "
                                                    + "geocolumn=\"" + geocolumn + "\" "
-                                                   + "query=\""     + escapeXMLString( query ) + "\""
-                                                   + ( am.optionalValue( "elevation" ).empty() ? "" : "elevation=\"" +  escapeXMLString( am.optionalValue( "elevation" ) ) + "\"" )
+                                                   + "query=\""     + escapeXMLString( queries[ilod] ) + "\" "
+                                                   + "tile=\""      + tile.str() + "\" "
+                                                   + postgisOptions( am )
+                                                   + arcTolerance[ilod]
                                                    + POSTGIS_EXTENSION;
 
                     pagedLod->setFileName( ilod,  pseudoFile );
@@ -332,8 +429,8 @@ void Interpreter::loadVectorPostgis( const AttributeMap& am )
         const std::string pseudoFile = "conn_info=\""       + escapeXMLString( am.value( "conn_info" ) )       + "\" "
                                        + "origin=\""          + escapeXMLString( am.value( "origin" ) )          + "\" "
                                        + "geocolumn=\"" + escapeXMLString( geocolumn ) + "\" "
-                                       + "query=\""           + escapeXMLString( am.value( "query" ) )           + "\""
-                                       + ( am.optionalValue( "elevation" ).empty() ? "" : "elevation=\"" +  escapeXMLString( am.optionalValue( "elevation" ) ) + "\"" )
+                                       + "query=\""           + escapeXMLString( am.value( "query" ) )           + "\" "
+                                       + postgisOptions( am )
                                        + POSTGIS_EXTENSION;
         osg::ref_ptr<osg::Node> node = osgDB::readNodeFile( pseudoFile );
 
@@ -410,6 +507,13 @@ void Interpreter::loadElevation( const AttributeMap& am )
 
         const size_t numTilesY = ( ymax-ymin )/tileSize + 1;
 
+        // the same query for all tiles, the tile envelope is a parameter
+        std::vector< std::string > queries;
+
+        for ( size_t ilod = 0; ilod < lodDistance.size()-1; ilod++ ) {
+            queries.push_back( preparedTileQuery( am.value( "query_"+intToString( ilod ) ) ) );
+        }
+
         osg::ref_ptr<osg::Group> group = new osg::Group;
 
         for ( size_t ix=0; ix<numTilesX; ix++ ) {
@@ -427,7 +531,8 @@ void Interpreter::loadElevation( const AttributeMap& am )
                         "file=\""      + escapeXMLString( am.value( "file" ) )              + "\" "
                         + "origin=\""    + escapeXMLString( am.value( "origin" ) )            + "\" "
                         + "mesh_size=\"" + escapeXMLString( am.value( "mesh_size_"+lodIdx ) ) + "\" "
-                        + "extent=\""    + extent.str()                                   + "\" " + MNT_EXTENSION;
+                        + "extent=\""    + extent.str()                                   + "\" "
+                        + mntOptions( am ) + MNT_EXTENSION;
 
                     pagedLod->setFileName( ilod,  pseudoFile );
                     pagedLod->setRange( ilod, lodDistance[ilod+1], lodDistance[ilod] );
@@ -447,7 +552,8 @@ void Interpreter::loadElevation( const AttributeMap& am )
             "file=\""      + escapeXMLString( am.value( "file" ) )              + "\" "
             + "origin=\""    + escapeXMLString( am.value( "origin" ) )            + "\" "
             + "mesh_size=\"" + escapeXMLString( am.value( "mesh_size" ) )         + "\" "
-            + "extent=\""    + escapeXMLString( am.value( "extent" ) )            + "\" " + MNT_EXTENSION;
+            + "extent=\""    + escapeXMLString( am.value( "extent" ) )            + "\" "
+            + mntOptions( am ) + MNT_EXTENSION;
         osg::ref_ptr<osg::Node> node = osgDB::readNodeFile( pseudoFile );
 
         if ( !node.get() ) {
@@ -505,6 +611,47 @@ const osg::Vec4 htmlColor( const std::string& html )
     return osg::Vec4( w, x, y, z );
 }
 
+// lighting of layers loaded with shading="flat", they have no normals
+inline
+osg::Program* flatProgram()
+{
+    static osg::ref_ptr<osg::Program> program;
+
+    if ( !program.valid() ) {
+        program = new osg::Program;
+        program->addShader( new osg::Shader( osg::Shader::VERTEX, osgGIS::FLAT_VERTEX_SOURCE ) );
+        program->addShader( new osg::Shader( osg::Shader::VERTEX, osgGIS::CLASS_COLOR_VERTEX_SOURCE ) );
+        program->addShader( new osg::Shader( osg::Shader::VERTEX, osgGIS::FEATURE_FILTER_VERTEX_SOURCE ) );
+        program->addShader( new osg::Shader( osg::Shader::FRAGMENT, osgGIS::FLAT_FRAGMENT_SOURCE ) );
+        program->addShader( new osg::Shader( osg::Shader::FRAGMENT, osgGIS::LIGHTING_FRAGMENT_SOURCE ) );
+        program->addBindAttribLocation( "featureClass", osgGIS::CLASS_ATTRIBUTE );
+        program->addBindAttribLocation( "featureId", osgGIS::FEATURE_ID_ATTRIBUTE );
+    }
+
+    return program.get();
+}
+
+// lighting of classified layers with normals, the palette replaces the fixed pipeline
+// material, quantized tiles have their own program
+inline
+osg::Program* smoothProgram()
+{
+    static osg::ref_ptr<osg::Program> program;
+
+    if ( !program.valid() ) {
+        program = new osg::Program;
+        program->addShader( new osg::Shader( osg::Shader::VERTEX, osgGIS::SMOOTH_VERTEX_SOURCE ) );
+        program->addShader( new osg::Shader( osg::Shader::VERTEX, osgGIS::CLASS_COLOR_VERTEX_SOURCE ) );
+        program->addShader( new osg::Shader( osg::Shader::VERTEX, osgGIS::FEATURE_FILTER_VERTEX_SOURCE ) );
+        program->addShader( new osg::Shader( osg::Shader::FRAGMENT, osgGIS::SMOOTH_FRAGMENT_SOURCE ) );
+        program->addShader( new osg::Shader( osg::Shader::FRAGMENT, osgGIS::LIGHTING_FRAGMENT_SOURCE ) );
+        program->addBindAttribLocation( "featureClass", osgGIS::CLASS_ATTRIBUTE );
+        program->addBindAttribLocation( "featureId", osgGIS::FEATURE_ID_ATTRIBUTE );
+    }
+
+    return program.get();
+}
+
 void Interpreter::setSymbology( const AttributeMap& am )
 {
     osg::ref_ptr<osg::StateSet> stateset = new osg::StateSet;
@@ -531,15 +678,124 @@ void Interpreter::setSymbology( const AttributeMap& am )
     //stateset->setMode( GL_LIGHTING, osg::StateAttribute::ON );
     stateset->setAttribute( material,osg::StateAttribute::OVERRIDE );
 
+    // colors of the classes of layers loaded with a class_column, space separated,
+    // vertices are lit with the color of their class instead of the material
+    const std::string palette = am.optionalValue( "palette" );
+
+    if ( !palette.empty() ) {
+        osg::ref_ptr<osg::Uniform> colors = new osg::Uniform( osg::Uniform::FLOAT_VEC4, "palette", osgGIS::MAX_CLASSES );
+        std::stringstream ps( palette );
+        std::string color;
+        unsigned numColors = 0;
+
+        for ( ; ps >> color; numColors++ ) {
+            if ( numColors == osgGIS::MAX_CLASSES ) {
+                throw std::runtime_error( "more than " + intToString( osgGIS::MAX_CLASSES ) + " colors in palette" );
+            }
+
+            colors->setElement( numColors, htmlColor( color ) );
+        }
+
+        stateset->addUniform( colors.get() );
+        stateset->addUniform( new osg::Uniform( "classified", true ) );
+    }
+
+    if ( am.optionalValue( "shading" ) == "flat" ) {
+        stateset->setAttributeAndModes( flatProgram() );
+        stateset->addUniform( new osg::Uniform( "visibility", int( osgGIS::VISIBILITY_TEXTURE_UNIT ) ) );
+    }
+    else if ( !palette.empty() ) {
+        stateset->setAttributeAndModes( smoothProgram() );
+        stateset->addUniform( new osg::Uniform( "visibility", int( osgGIS::VISIBILITY_TEXTURE_UNIT ) ) );
+    }
+
     _viewer->setStateSet( am.value( "id" ), stateset.get() );
 }
 
+// layers must be loaded with an id_column, only the features listed in ids are shown:
+// none if the list is empty, all of them again with ids="all"
+void Interpreter::filterFeatures( const AttributeMap& am )
+{
+    const std::string ids = am.value( "ids" );
+
+    if ( ids == "all" ) {
+        _viewer->setFeatureFilter( am.value( "id" ), 0, smoothProgram() );
+        return;
+    }
+
+    // one bit per feature id, in 32 bits texels, at least one for an empty buffer
+    std::vector< GLuint > bits( 1, 0 );
+    std::stringstream is( ids );
+    unsigned fid;
+
+    while ( is >> fid ) {
+        if ( fid / 32 >= bits.size() ) {
+            bits.resize( fid / 32 + 1, 0 );
+        }
+
+        bits[ fid / 32 ] |= 1u << ( fid % 32 );
+    }
+
+    if ( !is.eof() ) {
+        throw std::runtime_error( "cannot parse ids" );
+    }
+
+    osg::ref_ptr<osg::Image> visibility = new osg::Image;
+    visibility->allocateImage( int( bits.size() ), 1, 1, GL_RED_INTEGER_EXT, GL_UNSIGNED_INT );
+    visibility->setInternalTextureFormat( GL_R32UI );
+    std::copy( bits.begin(), bits.end(), reinterpret_cast< GLuint* >( visibility->data() ) );
+
+    _viewer->setFeatureFilter( am.value( "id" ), visibility.get(), smoothProgram() );
+}
+
+// layers must be loaded with an id_column and the attributes to keep
+void Interpreter::getAttributes( const AttributeMap& am )
+{
+    unsigned featureId;
+
+    if ( !( std::stringstream( am.value( "fid" ) ) >> featureId ) ) {
+        throw std::runtime_error( "cannot parse fid" );
+    }
+
+    osg::ref_ptr<const osgGIS::AttributeTable> table;
+    size_t row;
+
+    if ( !_viewer->findAttributes( am.value( "id" ), featureId, table, row ) ) {
+        throw std::runtime_error( "no attributes loaded for fid " + am.value( "fid" ) );
+    }
+
+    std::cout << "<attributes id=\"" << escapeXMLString( am.value( "id" ) ) << "\" fid=\"" << featureId << "\">\n";
+
+    for ( size_t c = 0; c < table->numColumns(); c++ ) {
+        std::cout << "<attribute name=\"" << escapeXMLString( table->name( c ) ) << "\"";
+
+        if ( table->isNull( c, row ) ) {
+            std::cout << " null=\"1\"";
+        }
+        else if ( table->type( c ) == osgGIS::AttributeTable::STRING ) {
+            std::cout << " value=\"" << escapeXMLString( table->dictionary( c )[ table->codes( c )[row] ] ) << "\"";
+        }
+        else {
+            // a local stream, cout keeps its precision for the other commands
+            std::stringstream value;
+            value << std::setprecision( 16 ) << table->numbers( c )[row];
+            std::cout << " value=\"" << value.str() << "\"";
+        }
+
+        std::cout << "/>\n";
+    }
+
+    std::cout << "</attributes>\n";
+}
+
 void Interpreter::setFullExtent( const AttributeMap& )
 {
     throw std::runtime_error( "not implemented" );
 }
 
-const std::string tileQuery( std::string query, float xmin, float ymin, float xmax, float ymax )
+// replaces the spatial meta comment by the condition on the envelope
+inline
+const std::string spatialQuery( std::string query, const std::string& envelope )
 {
     const char* spacialMetaComments[] = {"/**WHERE TILE &&", "/**AND TILE &&"};
 
@@ -559,11 +815,9 @@ const std::string tileQuery( std::string query, float xmin, float ymin, float xm
 
             query.replace ( end, 2, "" );
 
-            std::stringstream bbox;
-            bbox << "ST_MakeEnvelope(" << xmin << "," << ymin << "," << xmax << "," << ymax << ")";
             const size_t tile = query.find( "TILE", where );
             assert( tile != std::string::npos );
-            query.replace( tile, 4, bbox.str().c_str() );
+            query.replace( tile, 4, envelope );
         }
     }
 
@@ -574,5 +828,17 @@ const std::string tileQuery( std::string query, float xmin, float ymin, float xm
     return query;
 }
 
+const std::string tileQuery( std::string query, float xmin, float ymin, float xmax, float ymax )
+{
+    std::stringstream bbox;
+    bbox << "ST_MakeEnvelope(" << xmin << "," << ymin << "," << xmax << "," << ymax << ")";
+    return spatialQuery( query, bbox.str() );
+}
+
+const std::string preparedTileQuery( const std::string& query )
+{
+    return spatialQuery( query, "ST_MakeEnvelope($1,$2,$3,$4)" );
+}
+
 }
 }
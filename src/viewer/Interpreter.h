@@ -67,6 +67,9 @@ struct Interpreter: public OpenThreads::Thread {
     void addSky( const AttributeMap& );
     void lookAt( const AttributeMap& );
     void writeFile( const AttributeMap& );
+    void pick( const AttributeMap& );
+    void filterFeatures( const AttributeMap& );
+    void getAttributes( const AttributeMap& );
 
 private:
 
@@ -79,6 +82,9 @@ private:
 
 const std::string tileQuery( std::string query, float xmin, float ymin, float xmax, float ymax );
 
+//! the tile envelope is replaced by parameters $1 to $4 (xmin ymin xmax ymax)
+const std::string preparedTileQuery( const std::string& query );
+
 }
 }
 
@@ -37,5 +37,12 @@ int main()
         assert(  squery == "SELECT * FROM table WHERE gid=2 AND ST_MakeEnvelope(-1,-2,3,4) && gom /*comment*/" );
     }
 
+    {
+        const std::string query( "SELECT * FROM table /**WHERE TILE && gom*/ /*comment*/" );
+        const std::string squery( Stack3d::Viewer::preparedTileQuery( query ) );
+        std::cout << squery << "\n";
+        assert(  squery == "SELECT * FROM table WHERE ST_MakeEnvelope($1,$2,$3,$4) && gom /*comment*/" );
+    }
+
     return EXIT_SUCCESS;
 }
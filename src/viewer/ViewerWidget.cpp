@@ -18,6 +18,8 @@
  */
 #include "ViewerWidget.h"
 
+#include <osgGIS/Shaders.h>
+
 #include <osg/CullFace>
 #include <osg/Material>
 #include <osgGA/KeySwitchMatrixManipulator>
@@ -29,6 +31,8 @@
 #include <osgText/Text>
 #include <osg/io_utils>
 #include <osg/Texture2D>
+#include <osg/TextureBuffer>
+#include <osgUtil/LineSegmentIntersector>
 
 #include <cassert>
 #include <stdexcept>
@@ -37,6 +41,56 @@
 namespace Stack3d {
 namespace Viewer {
 
+namespace {
+//! false if the feature filter of the group, see setFeatureFilter, hides the feature
+bool featureVisible( const osg::Group* filter, unsigned featureId )
+{
+    const osg::StateSet* stateSet = filter ? filter->getStateSet() : 0;
+    const osg::TextureBuffer* texture = stateSet ? dynamic_cast< const osg::TextureBuffer* >(
+            stateSet->getTextureAttribute( osgGIS::VISIBILITY_TEXTURE_UNIT, osg::StateAttribute::TEXTURE ) ) : 0;
+    const osg::Image* visibility = texture ? texture->getImage() : 0;
+
+    if ( !visibility ) {
+        return true;
+    }
+
+    if ( featureId / 32 >= unsigned( visibility->s() ) ) {
+        return false;
+    }
+
+    const GLuint* bits = reinterpret_cast< const GLuint* >( visibility->data() );
+    return bits[ featureId / 32 ] & ( 1u << ( featureId % 32 ) );
+}
+
+//! finds the attribute table, attached by the postgis plugin, of a tile holding a feature
+struct FindAttributes : osg::NodeVisitor {
+    FindAttributes( unsigned featureId )
+        : osg::NodeVisitor( osg::NodeVisitor::TRAVERSE_ALL_CHILDREN )
+        , _featureId( featureId )
+        , _row( 0 )
+    {}
+
+    void apply( osg::Node& node ) {
+        if ( _table.valid() ) {
+            return;
+        }
+
+        const osgGIS::AttributeTable* table = dynamic_cast< const osgGIS::AttributeTable* >( node.getUserData() );
+
+        if ( table && table->find( _featureId, _row ) ) {
+            _table = table;
+            return;
+        }
+
+        traverse( node );
+    }
+
+    const unsigned _featureId;
+    osg::ref_ptr<const osgGIS::AttributeTable> _table;
+    size_t _row;
+};
+}
+
 const char* vertSourceSSAO = {
     "uniform vec2 g_Resolution;\n"
     "uniform float m_SubPixelShift;\n"
@@ -271,8 +325,11 @@ void ViewerWidget::addNode( const std::string& nodeId, osg::Node* node ) volatil
         throw std::runtime_error( "node '" + nodeId + "' already exists" );
     }
 
-    that->_root->addChild( node );
+    osg::ref_ptr<osg::Group> filter = new osg::Group;
+    filter->addChild( node );
+    that->_root->addChild( filter.get() );
     that->_nodeMap.insert( std::make_pair( nodeId, node ) );
+    that->_filterMap.insert( std::make_pair( nodeId, filter ) );
 }
 
 void ViewerWidget::removeNode(  const std::string& nodeId ) volatile {
@@ -285,7 +342,7 @@ void ViewerWidget::removeNode(  const std::string& nodeId ) volatile {
         throw std::runtime_error( "cannot find node '" + nodeId + "'" );
     }
 
-    that->_root->removeChild( found->second.get() );
+    that->_root->removeChild( that->_filterMap[ nodeId ].get() );
 }
 
 void ViewerWidget::setVisible( const std::string& nodeId, bool visible ) volatile {
@@ -339,6 +396,115 @@ void ViewerWidget::writeFile( const std::string& filename ) volatile {
     }
 }
 
+void ViewerWidget::setFeatureFilter( const std::string& nodeId, osg::Image* visibility, osg::Program* program ) volatile {
+    ViewerWidget* that = const_cast< ViewerWidget* >( this );
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( that->_mutex );
+
+    const FilterMap::const_iterator found = that->_filterMap.find( nodeId );
+
+    if ( found == that->_filterMap.end() ) {
+        throw std::runtime_error( "cannot find node '" + nodeId + "'" );
+    }
+
+    if ( !visibility ) {
+        found->second->setStateSet( 0 );
+        return;
+    }
+
+    osg::StateSet* stateset = found->second->getOrCreateStateSet();
+    osg::TextureBuffer* texture = dynamic_cast< osg::TextureBuffer* >(
+                                      stateset->getTextureAttribute( osgGIS::VISIBILITY_TEXTURE_UNIT, osg::StateAttribute::TEXTURE ) );
+
+    // a new filter is a single upload of the bitset
+    if ( texture ) {
+        texture->setImage( visibility );
+        return;
+    }
+
+    osg::ref_ptr<osg::TextureBuffer> bitset = new osg::TextureBuffer( visibility );
+    bitset->setInternalFormat( GL_R32UI );
+    stateset->setTextureAttribute( osgGIS::VISIBILITY_TEXTURE_UNIT, bitset.get() );
+    stateset->addUniform( new osg::Uniform( "visibility", int( osgGIS::VISIBILITY_TEXTURE_UNIT ) ) );
+    stateset->addUniform( new osg::Uniform( "filtered", true ) );
+    stateset->setAttributeAndModes( program );
+}
+
+bool ViewerWidget::findAttributes( const std::string& nodeId, unsigned featureId,
+                                   osg::ref_ptr<const osgGIS::AttributeTable>& table, size_t& row ) volatile {
+    ViewerWidget* that = const_cast< ViewerWidget* >( this );
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( that->_mutex );
+
+    const NodeMap::const_iterator found = that->_nodeMap.find( nodeId );
+
+    if ( found == that->_nodeMap.end() ) {
+        throw std::runtime_error( "cannot find node '" + nodeId + "'" );
+    }
+
+    // the graph is searched under the lock; the table found is not modified once
+    // loaded, the caller reads it after the lock is released
+    FindAttributes visitor( featureId );
+    found->second->accept( visitor );
+    table = visitor._table;
+    row = visitor._row;
+    return table.valid();
+}
+
+bool ViewerWidget::pick( float x, float y, std::string& nodeId, unsigned& featureId, osg::Vec3d& point ) volatile {
+    ViewerWidget* that = const_cast< ViewerWidget* >( this );
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( that->_mutex );
+
+    // kd-trees, when the tiles have one, are used by default
+    osg::ref_ptr<osgUtil::LineSegmentIntersector> picker =
+        new osgUtil::LineSegmentIntersector( osgUtil::Intersector::WINDOW, x, y );
+    osgUtil::IntersectionVisitor visitor( picker.get() );
+    that->getCamera()->accept( visitor );
+
+    // intersections are sorted front to back
+    const osgUtil::LineSegmentIntersector::Intersections& intersections = picker->getIntersections();
+
+    for ( osgUtil::LineSegmentIntersector::Intersections::const_iterator it = intersections.begin(); it != intersections.end(); it++ ) {
+        const osg::Geometry* geom = it->drawable.valid() ? it->drawable->asGeometry() : 0;
+        const osg::UIntArray* ids = geom ? dynamic_cast< const osg::UIntArray* >( geom->getVertexAttribArray( osgGIS::FEATURE_ID_ATTRIBUTE ) ) : 0;
+
+        // instanced geometries have one id per instance, not per vertex
+        if ( !ids || !geom->getVertexArray() || ids->size() != geom->getVertexArray()->getNumElements()
+                || it->indexList.empty() || it->indexList[0] >= ids->size() ) {
+            continue;
+        }
+
+        // the layer is the node of the map on the path
+        NodeMap::const_iterator layer = that->_nodeMap.end();
+
+        for ( osg::NodePath::const_iterator n = it->nodePath.begin(); n != it->nodePath.end() && layer == that->_nodeMap.end(); n++ ) {
+            for ( NodeMap::const_iterator l = that->_nodeMap.begin(); l != that->_nodeMap.end(); l++ ) {
+                if ( l->second.get() == *n ) {
+                    layer = l;
+                    break;
+                }
+            }
+        }
+
+        if ( layer == that->_nodeMap.end() ) {
+            continue;
+        }
+
+        const unsigned fid = ( *ids )[ it->indexList[0] ];
+        const FilterMap::const_iterator filter = that->_filterMap.find( layer->first );
+
+        // hidden features are drawn off screen, but still intersected
+        if ( filter != that->_filterMap.end() && !featureVisible( filter->second.get(), fid ) ) {
+            continue;
+        }
+
+        nodeId = layer->first;
+        featureId = fid;
+        point = it->getWorldIntersectPoint();
+        return true;
+    }
+
+    return false;
+}
+
 }
 }
 
@@ -22,6 +22,7 @@
 #include <osgViewer/Viewer>
 #include <osgDB/WriteFile>
 #include <osgViewer/ViewerEventHandlers>
+#include <osgGIS/AttributeTable.h>
 
 #include <queue>
 
@@ -39,6 +40,23 @@ struct ViewerWidget: osgViewer::Viewer {
     void lookAtExtent( double xmin, double ymin, double xmax, double ymax ) volatile;
     void writeFile( const std::string& filename ) volatile;
 
+    //! @brief first feature under the pixel (x,y), counted from the bottom left corner
+    //!        of the window, only geometries with one feature id per vertex are considered,
+    //!        features hidden by the filter are skipped
+    //! @return false if there is no such feature
+    bool pick( float x, float y, std::string& nodeId, unsigned& featureId, osg::Vec3d& point ) volatile;
+
+    //! @brief shows only the features of the node whose bit is set in visibility (GL_R32UI
+    //!        texels of 32 features, ids beyond the image are hidden), 0 to show them all,
+    //!        see osgGIS/Shaders.h
+    //! @param program lights geometries that have no program of their own while filtered
+    void setFeatureFilter( const std::string& nodeId, osg::Image* visibility, osg::Program* program ) volatile;
+
+    //! @brief attributes of a feature, from the first loaded tile of the node that has it
+    //! @return false if no such tile is loaded
+    bool findAttributes( const std::string& nodeId, unsigned featureId,
+                         osg::ref_ptr<const osgGIS::AttributeTable>& table, size_t& row ) volatile;
+
 private:
 
     osgGA::CameraManipulator* getCurrentManipulator();
@@ -46,6 +64,10 @@ private:
     osg::ref_ptr<osg::Group> _root;
     typedef std::map< std::string, osg::ref_ptr<osg::Node> > NodeMap;
     NodeMap _nodeMap;
+    //! the parent of each node, holding its feature filter, so that the stateset of
+    //! the node can be replaced without losing it
+    typedef std::map< std::string, osg::ref_ptr<osg::Group> > FilterMap;
+    FilterMap _filterMap;
     void frame( double time );
 };
 